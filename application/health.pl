@@ -0,0 +1,37 @@
+#!/usr/bin/env perl
+# vim:ts=4:sw=4:expandtab
+#
+# Prints the node statistics the busmaster publishes on ff05::b5:fe (see
+# busmaster/health.c).
+#
+# Usage: health.pl [interface]
+
+use strict;
+use warnings;
+use AnyEvent;
+use v5.10;
+use lib qw(lib);
+use Hausbus;
+
+my $bus = Hausbus->new(groups => [ 0xfe ], interface => ($ARGV[0] // 'eth0'));
+
+$bus->on_read(sub {
+    my ($sender, $group, $data) = @_;
+
+    return if length($data) < 8;
+    my ($version, $records, $uptime, $crc) = unpack('CCNn', $data);
+    if ($version != 1) {
+        say "unbekannte Version $version";
+        return;
+    }
+
+    say "busmaster läuft seit ${uptime}s, $crc kaputte Header ohne Zuordnung";
+    for my $i (0 .. $records - 1) {
+        my ($node, $age, $rtt_avg, $rtt_max, $errors, $timeouts, $up, $down) =
+            unpack('CCCCnnnn', substr($data, 8 + 12 * $i, 12));
+        printf "  %2d: zuletzt vor %3s s, rtt %5.2f ms (max %2d ms), %5d crc, %5d timeouts, %5d/%5d frames hoch/runter\n",
+            $node, ($age == 255 ? '>254' : $age), $rtt_avg / 8, $rtt_max, $errors, $timeouts, $up, $down;
+    }
+});
+
+AnyEvent->condvar->recv
@@ -43,33 +43,61 @@ sub BUILD {
 
     for my $group (@groups) {
         my $address = 'ff05::b5:' . sprintf("%x", $group);
-        my $socket = IO::Socket::Multicast6->new(
-            Domain => AF_INET6,
-            LocalAddr => $address,
-            LocalPort => 41999,
-        );
-
-        $socket->mcast_add($address, $interface);
-
-        my $io;
-        $io = AnyEvent->io(
-            fh => $socket,
-            poll => "r",
-            cb => sub {
-                return unless $self->has_read_cb;
-
-                my $buffer;
-                my $sender = $socket->recv($buffer, 256);
-                my ($port, $packed_addr) = unpack_sockaddr_in6($sender);
-                $sender = inet_ntop(AF_INET6, $packed_addr);
-                $sender =~ s/^fd1a:56e6:97e9:0:b5:ff:fe00://g;
-
-                $self->on_read->($sender, $group, $buffer);
-            }
-        );
-
-        push @watchers, $io;
+
+        # 41999: one bus frame per datagram, 41998: frames aggregated by the
+        # busmaster (UPSTREAM_AGGREGATE_MS, see busmaster/main.c)
+        for my $port (41999, 41998) {
+            my $socket = IO::Socket::Multicast6->new(
+                Domain => AF_INET6,
+                LocalAddr => $address,
+                LocalPort => $port,
+            );
+
+            $socket->mcast_add($address, $interface);
+
+            my $io;
+            $io = AnyEvent->io(
+                fh => $socket,
+                poll => "r",
+                cb => sub {
+                    return unless $self->has_read_cb;
+
+                    my $buffer;
+                    my $sender = $socket->recv($buffer, 256);
+                    my ($sender_port, $packed_addr) = unpack_sockaddr_in6($sender);
+                    $sender = inet_ntop(AF_INET6, $packed_addr);
+                    $sender =~ s/^fd1a:56e6:97e9:0:b5:ff:fe00://g;
+
+                    if ($port == 41999) {
+                        $self->on_read->($sender, $group, $buffer);
+                        return;
+                    }
+
+                    for my $record (_records($buffer)) {
+                        $self->on_read->(sprintf("%x", $record->[0]), $group, $record->[1]);
+                    }
+                }
+            );
+
+            push @watchers, $io;
+        }
+    }
+}
+
+# Splits an aggregated datagram into [ source, payload ] pairs. Each record
+# is the bus address of the sender, the length and the payload.
+sub _records {
+    my ($buffer) = @_;
+    my @records;
+
+    while (length($buffer) >= 2) {
+        my ($source, $length) = unpack('CC', $buffer);
+        last if length($buffer) < 2 + $length;
+        push @records, [ $source, substr($buffer, 2, $length) ];
+        $buffer = substr($buffer, 2 + $length);
     }
+
+    return @records;
 }
 
 sub send {
@@ -87,4 +115,41 @@ sub send {
   $sock->send($data);
 }
 
+# Sends commands for several nodes in as few datagrams as possible, see
+# busmaster/README. Takes (target, data) pairs, the target in hex as for
+# send(). A command has to fit a bus frame (27 bytes), the busmaster drops
+# longer ones.
+sub send_batch {
+  my ($self, @commands) = @_;
+
+  # UIP_BUFSIZE minus Ethernet, IPv6 and UDP header
+  my $max = 200 - 14 - 40 - 8;
+  # payload of a bus frame
+  my $max_command = 27;
+
+  # check all of them first, so that nothing is sent half
+  for (my $i = 0; $i < @commands; $i += 2) {
+    die "command for $commands[$i] longer than $max_command bytes\n"
+      if length($commands[$i + 1]) > $max_command;
+  }
+
+  my $sock = IO::Socket::INET6->new(
+    Domain => AF_INET6,
+    PeerAddr => 'fd1a:56e6:97e9:0:b5:ff:fe00:0',
+    PeerPort => 41998,
+    Proto => 'udp'
+  );
+
+  my $datagram = '';
+  while (my ($target, $data) = splice(@commands, 0, 2)) {
+    my $record = pack('CC/a*', hex($target), $data);
+    if (length($datagram) + length($record) > $max) {
+      $sock->send($datagram);
+      $datagram = '';
+    }
+    $datagram .= $record;
+  }
+  $sock->send($datagram) if length($datagram) > 0;
+}
+
 1
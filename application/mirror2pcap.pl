@@ -0,0 +1,129 @@
+#!/usr/bin/env perl
+# vim:ts=4:sw=4:expandtab
+#
+# Writes the bytes of the bus mirror (ff05::b5:fc, see lib/mirror.c) to a
+# pcap file, one record per bus frame: header and payload as they were on
+# the bus, link type USER0 (147). A frame starts at a byte with the address
+# bit or after a pause of more than two characters, so frames with a broken
+# header end up in the file, too. Receive errors, broken headers and lost
+# bytes are printed.
+#
+# With --mirror, the busmaster first switches the mirror off (0) or on (1).
+#
+# Usage: mirror2pcap.pl [--mirror 0|1] [--interface eth0] [capture.pcap]
+
+use strict;
+use warnings;
+use AnyEvent;
+use Getopt::Long;
+use IO::File;
+use Time::HiRes qw(time);
+use v5.10;
+use lib qw(lib);
+use Hausbus;
+
+use constant {
+    ADDRESS      => 0x01,
+    PARITY_ERROR => 0x04,
+    OVERRUN      => 0x08,
+    FRAME_ERROR  => 0x10,
+    LINKTYPE     => 147,
+    # two characters at 38400 baud, 11 bits each
+    PAUSE        => 2 * 11 / 38400,
+};
+
+my $interface = 'eth0';
+my $mirror;
+GetOptions('interface=s' => \$interface, 'mirror=i' => \$mirror)
+    or die "Usage: $0 [--mirror 0|1] [--interface eth0] [capture.pcap]\n";
+
+my $bus = Hausbus->new(groups => [ 0xfc ], interface => $interface);
+$bus->send(0, 'mirror' . chr($mirror)) if defined($mirror);
+exit 0 unless @ARGV;
+
+my $pcap = IO::File->new($ARGV[0], 'w') or die "$ARGV[0]: $!\n";
+binmode($pcap);
+$pcap->autoflush(1);
+print $pcap pack('LSSlLLL', 0xa1b2c3d4, 2, 4, 0, 0, 65535, LINKTYPE);
+
+# the millisecond counter of the busmaster wraps after 65 s: the wall clock
+# between two datagrams tells how often
+my ($wall_start, $last_wall, $last_ms, $elapsed);
+
+sub busmaster_time {
+    my ($ms) = @_;
+    my $now = time();
+
+    if (!defined($wall_start)) {
+        ($wall_start, $elapsed) = ($now, 0);
+    } else {
+        my $delta = ($ms - $last_ms) & 0xffff;
+        my $wraps = int((($now - $last_wall) * 1000 - $delta) / 65536 + 0.5);
+        $elapsed += $delta + 65536 * ($wraps > 0 ? $wraps : 0);
+    }
+    ($last_wall, $last_ms) = ($now, $ms);
+
+    return $wall_start + $elapsed / 1000;
+}
+
+my @frame;
+my ($frame_at, $last_at);
+my ($sequence, $lost);
+
+sub write_frame {
+    return unless @frame;
+
+    my $data = pack('C*', @frame);
+    my $sec = int($frame_at);
+    print $pcap pack('LLLL', $sec, int(($frame_at - $sec) * 1e6), length($data), length($data)), $data;
+
+    if (@frame >= 6) {
+        my $sum = 0;
+        $sum += $frame[$_] for (0, 1, 3, 4, 5);
+        printf "%.6f: kaputter Header (Ziel %d, Quelle %d)\n", $frame_at, $frame[0], $frame[1]
+            if ($sum & 0xff) != $frame[2];
+    }
+    @frame = ();
+}
+
+# the header tells the length of the frame
+sub frame_complete {
+    return @frame >= 6 && @frame >= 6 + ($frame[4] << 8 | $frame[5]);
+}
+
+$bus->on_read(sub {
+    my ($sender, $group, $data) = @_;
+
+    return if length($data) < 10;
+    my ($version, $records, $seq, $lost_now, $ms, $per_ms) = unpack('CCnnnn', $data);
+    if ($version != 1) {
+        say "unbekannte Version $version";
+        return;
+    }
+
+    my $missing = defined($sequence) ? ($seq - $sequence - 1) & 0xffff : 0;
+    say "$missing Datagramme fehlen" if $missing > 0;
+    my $dropped = defined($lost) ? ($lost_now - $lost) & 0xffff : 0;
+    say "$dropped Bytes verloren, der Busmaster kam nicht hinterher" if $dropped > 0;
+    ($sequence, $lost) = ($seq, $lost_now);
+
+    my $start = busmaster_time($ms);
+    for my $i (0 .. $records - 1) {
+        my ($byte, $flags, $ticks) = unpack('CCn', substr($data, 10 + 4 * $i, 4));
+        my $at = $start + $ticks / $per_ms / 1000;
+
+        write_frame() if ($flags & ADDRESS) || (defined($last_at) && $at - $last_at > PAUSE);
+        $frame_at = $at unless @frame;
+        push @frame, $byte;
+        $last_at = $at;
+
+        printf "%.6f: Empfangsfehler bei 0x%02x:%s%s%s\n", $at, $byte,
+            ($flags & FRAME_ERROR ? ' Rahmen' : ''),
+            ($flags & OVERRUN ? ' Überlauf' : ''),
+            ($flags & PARITY_ERROR ? ' Parität' : '') if $flags & (FRAME_ERROR | OVERRUN | PARITY_ERROR);
+    }
+
+    write_frame() if frame_complete();
+});
+
+AnyEvent->condvar->recv
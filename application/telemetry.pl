@@ -0,0 +1,54 @@
+#!/usr/bin/env perl
+# vim:ts=4:sw=4:expandtab
+#
+# Prints the events the busmaster publishes on ff05::b5:fd (see
+# lib/telemetry.c). With --level, the busmaster first records events up to
+# that level (0 off, 1 error, 2 info, 3 debug).
+#
+# Usage: telemetry.pl [--level n] [interface]
+
+use strict;
+use warnings;
+use AnyEvent;
+use Getopt::Long;
+use v5.10;
+use lib qw(lib);
+use Hausbus;
+
+my %events = (
+    1 => sub { sprintf "gestartet, ENC28J60 Rev. %d", $_[0] },
+    2 => sub { "ping an $_[0]" },
+    3 => sub { "pong von $_[0], $_[1] Frames warten" },
+    4 => sub { "sendreq an $_[0], noch $_[1] weitere" },
+    5 => sub { "Befehl an $_[0], $_[1] Byte" },
+    6 => sub { sprintf "kaputter Header (Ziel %d, Quelle %d)", @_ },
+    7 => sub { "serielle Schnittstelle: $_[0] Byte im Puffer, $_[1] fehlen" },
+    8 => sub { "Level jetzt $_[0]" },
+);
+
+my $level;
+GetOptions('level=i' => \$level) or die "Usage: $0 [--level n] [interface]\n";
+
+my $bus = Hausbus->new(groups => [ 0xfd ], interface => ($ARGV[0] // 'eth0'));
+
+$bus->send(0, 'level' . chr($level)) if defined($level);
+
+$bus->on_read(sub {
+    my ($sender, $group, $data) = @_;
+
+    return if length($data) < 6;
+    my ($version, $current, $lost, $records) = unpack('CCnC', $data);
+    if ($version != 1) {
+        say "unbekannte Version $version";
+        return;
+    }
+
+    say "busmaster (Level $current), $lost Ereignisse verloren" if $lost > 0;
+    for my $i (0 .. $records - 1) {
+        my ($code, $arg1, $arg2, $ms) = unpack('CCCn', substr($data, 6 + 5 * $i, 5));
+        my $event = $events{$code};
+        printf "  %5d ms: %s\n", $ms, ($event ? $event->($arg1, $arg2) : "Ereignis $code ($arg1, $arg2)");
+    }
+});
+
+AnyEvent->condvar->recv
@@ -10,42 +10,13 @@
 
 #include "compat.h"
 #include "enc28j60.h"
+#include "chksum.h"
 
 /* used to copy the old contents of uip_buf */
 static uint8_t saved[59];
 
 static const char mymac[6] PROGMEM = "\x02\xb5\x00\x00\x00\x00";
 
-static uint16_t chksum(uint16_t sum, const uint8_t *data, uint16_t len)
-{
-  uint16_t t;
-  const uint8_t *dataptr;
-  const uint8_t *last_byte;
-
-  dataptr = data;
-  last_byte = data + len - 1;
-
-  while(dataptr < last_byte) {  /* At least two more bytes */
-    t = (dataptr[0] << 8) + dataptr[1];
-    sum += t;
-    if(sum < t) {
-      sum++;            /* carry */
-    }
-    dataptr += 2;
-  }
-
-  if(dataptr == last_byte) {
-    t = (dataptr[0] << 8) + 0;
-    sum += t;
-    if(sum < t) {
-      sum++;            /* carry */
-    }
-  }
-
-  /* Return sum in host byte order. */
-  return sum;
-}
-
 static void start_icmpv6_reply(uint8_t *ip6) {
     memcpy(saved, uip_buf, 59);
     memcpy(uip_buf, uip_recvbuf + 6, 6);
@@ -19,6 +19,8 @@
 #include "bus.h"
 #include "compat.h"
 #include "icmpv6.h"
+#include "chksum.h"
+#include "telemetry.h"
 
 volatile uint8_t eth_to_rs[128];
 volatile uint8_t eth_to_rs_cnt = 0;
@@ -91,48 +93,10 @@ uint16_t uip_recvlen = 0;
 
 bool gotmsg = true;
 
-static uint16_t chksum(uint16_t sum, const uint8_t *data, uint16_t len)
-{
-  uint16_t t;
-  const uint8_t *dataptr;
-  const uint8_t *last_byte;
-
-  dataptr = data;
-  last_byte = data + len - 1;
-
-  while(dataptr < last_byte) {  /* At least two more bytes */
-    t = (dataptr[0] << 8) + dataptr[1];
-    sum += t;
-    if(sum < t) {
-      sum++;            /* carry */
-    }
-    dataptr += 2;
-  }
-
-  if(dataptr == last_byte) {
-    t = (dataptr[0] << 8) + 0;
-    sum += t;
-    if(sum < t) {
-      sum++;            /* carry */
-    }
-  }
-
-  /* Return sum in host byte order. */
-  return sum;
-}
-
-static void syslog_send(const char *str, int payload_len) {
+static void raw_send(const char *str, int payload_len) {
     uint16_t c;
     int len = 8 /* udp header */ + payload_len;
 
-    uip_buf[5] = 1;
-    uip_buf[53] = 1;
-
-    /* copy packet->source into the MAC and IPv6 address */
-    uip_buf[11] = 0;
-    uip_buf[37] = 0;
-
-
     /* IPv6 header → length */
     uip_buf[19] = len;
 
@@ -162,38 +126,22 @@ static void syslog_send(const char *str, int payload_len) {
     transmit_packet();
 }
 
-static void raw_send(const char *str, int payload_len) {
-    uint16_t c;
-    int len = 8 /* udp header */ + payload_len;
-
-    /* IPv6 header → length */
-    uip_buf[19] = len;
-
-    /* UDP header → length */
-    uip_buf[59] = len;
-
-    /* initialize UDP checksum to zero */
-    uip_buf[60] = 0x00;
-    uip_buf[61] = 0x00;
-
-    for (c = 0; c < payload_len; c++)
-        uip_buf[62 + c] = str[c];
-
-    /* calculate UDP checksum */
-    uint16_t sum = 0;
-    sum = len + 17;
-    sum = chksum(sum, (uint8_t*)&uip_buf[22], 2 * 16);
-    sum = chksum(sum, &uip_buf[54], len);
-    sum = (sum == 0 ? 0xffff : ~sum);
-    if (sum == 0)
-        sum = 0xffff;
+/* sends a report of the busmaster (source 0) to the multicast group */
+static void report_send(uint8_t group, const uint8_t *report, uint8_t len) {
+    uip_buf[5] = group;
+    uip_buf[53] = group;
+    uip_buf[11] = 0;
+    uip_buf[37] = 0;
+    raw_send((const char *)report, len);
+}
 
-    uip_buf[60] = (sum & 0xFF00) >> 8;
-    uip_buf[61] = (sum & 0x00FF);
+/* The main loop has no timer, time is counted in the delays it waits,
+ * which is close enough for the timestamps of the telemetry. */
+static uint16_t ms;
+#define WAIT_MS(x) do { _delay_ms(x); ms += (x); } while (0)
 
-    uip_len = 62 + payload_len;
-    transmit_packet();
-}
+/* skipping the bytes of a frame with a broken header */
+static bool skipping;
 
 
 ISR(USART0_RX_vect) {
@@ -290,6 +238,7 @@ int main(int argc, char *argv[]) {
     char obuf[64];
     snprintf(obuf, sizeof(obuf), "enc28j60 rev 0x%x\n", read_control_register(REG_EREVID));
     DBG(obuf);
+    TELEMETRY(TELEMETRY_INFO, TELEMETRY_BOOT, read_control_register(REG_EREVID), 0, ms);
 
     char buf[16] = "serial:       X\n";
     int cnt = 0;
@@ -335,20 +284,18 @@ int main(int argc, char *argv[]) {
                 struct buspkt *packet = (struct buspkt*)lbuffer;
 
                 send_packet(packet);
-                syslog_send("sent packet", strlen("sent packet"));
-                _delay_ms(25);
+                TELEMETRY(TELEMETRY_INFO, TELEMETRY_COMMAND_SENT, dest, pktlen, ms);
+                WAIT_MS(25);
                 sendit = 0;
                 eth_to_rs_cnt = 0;
         }
 #if 0
         network_process();
         if (uip_recvlen > 0) {
-            syslog_send("handling ethernet packet", strlen("handling ethernet packet"));
             DBG("Handling packet\r\n");
             handle_icmpv6();
 
             if (uip_recvbuf[20] == 0x11) {
-                syslog_send("handling udp packet", strlen("handling udp packet"));
                 /* UDP */
                 uint8_t *udp = uip_recvbuf + 14 + 40;
                 uint8_t len = udp[5] - 8;
@@ -358,32 +305,32 @@ int main(int argc, char *argv[]) {
                 fmt_packet(lbuffer, uip_recvbuf[53], 0xFF, recvpayload, len);
                 struct buspkt *packet = (struct buspkt*)lbuffer;
 
-                //syslog_send("sending packet", strlen("sending packet"));
                 send_packet(packet);
-                _delay_ms(25);
+                TELEMETRY(TELEMETRY_INFO, TELEMETRY_COMMAND_SENT, uip_recvbuf[53], len, ms);
+                WAIT_MS(25);
                 cnt = 85;
-                syslog_send("ethernet to rs485 done", strlen("ethernet to rs485 done"));
             }
 
-            //syslog_send("received a packet", strlen("received a packet"));
             buf[14] = uip_recvlen;
 
-            //syslog_send(uip_recvbuf, uip_recvlen);
             uip_recvlen = 0;
         }
 #endif
-        _delay_ms(10);
+        WAIT_MS(10);
         if (cnt++ == 100) {
             fmt_packet(lbuffer, 1, 0, "ping", 4);
             struct buspkt *packet = (struct buspkt*)lbuffer;
-            syslog_send("ping sent", strlen("ping sent"));
+            TELEMETRY(TELEMETRY_DEBUG, TELEMETRY_PING_SENT, 1, 0, ms);
             send_packet(packet);
             cnt = 0;
-        snprintf(obuf, sizeof(obuf), "cnt = %d, rem = %d\r\n",
-                eth_to_rs_cnt, eth_to_rs_rem);
-        syslog_send(obuf, strlen(obuf));
+            TELEMETRY(TELEMETRY_DEBUG, TELEMETRY_SERIAL_STATUS, eth_to_rs_cnt, eth_to_rs_rem, ms);
         }
 
+        uint8_t report[TELEMETRY_REPORT_MAX];
+        uint8_t report_len = telemetry_report(report, ms);
+        if (report_len > 0)
+            report_send(TELEMETRY_GROUP, report, report_len);
+
         uint8_t status = bus_status();
         if (status == BUS_STATUS_IDLE)
             continue;
@@ -398,20 +345,18 @@ int main(int argc, char *argv[]) {
             /* check for ping replies */
             if (packet->destination == 0x00 &&
                 memcmp(payload, "pong", strlen("pong")) == 0) {
-                syslog_send("pong received", strlen("pong received"));
+                TELEMETRY(TELEMETRY_DEBUG, TELEMETRY_PONG_RECEIVED, packet->source, payload[4], ms);
                 /* TODO: store that this controller is reachable */
                 /* check if the controller has any waiting messages */
                 if (payload[4] > 0) {
                     /* request the message */
                     fmt_packet(lbuffer, packet->source, 0, "send", 4);
                     struct buspkt *reply = (struct buspkt*)lbuffer;
-                    //syslog_send("sending packet", strlen("sending packet"));
-                    _delay_ms(25);
+                    WAIT_MS(25);
                     send_packet(reply);
-                    syslog_send("sendreq sent", strlen("sendreq sent"));
-                    //syslog_send(reply, reply->length_lo + sizeof(struct buspkt));
+                    TELEMETRY(TELEMETRY_DEBUG, TELEMETRY_SENDREQ_SENT, packet->source, 0, ms);
 
-                    _delay_ms(25);
+                    WAIT_MS(25);
                     cnt = 0;
                 }
             }
@@ -449,13 +394,18 @@ int main(int argc, char *argv[]) {
 
             /* discard the packet from serial buffer */
             packet_done();
+            skipping = false;
             continue;
         }
 
         if (status == BUS_STATUS_WRONG_CRC) {
-            syslog_send("broken", strlen("broken"));
             struct buspkt *packet = current_packet();
-            raw_send(packet, 16);
+            /* count the frame, not every byte skipped */
+            if (!skipping)
+                TELEMETRY(TELEMETRY_ERROR, TELEMETRY_BROKEN_HEADER, packet->destination, packet->source, ms);
+            skipping = true;
+            if (telemetry_level >= TELEMETRY_DEBUG)
+                report_send(1, (const uint8_t *)packet, 16);
             skip_byte();
             continue;
         }
@@ -0,0 +1,179 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * Compares lib/chksum.c with the chksum() the busmaster had before: first
+ * both are checked against each other for every length up to UIP_BUFSIZE
+ * and every alignment, then timed on frames of typical sizes.
+ *
+ * On the host the timing is wall clock (and meaningless for the AVR, but
+ * the check runs the C fallback):
+ *
+ * $ make chksumbench && ./chksumbench
+ *
+ * On the ATmega timer 1 counts CPU cycles, the results go out on USART0
+ * (38400 8N1, through the RS485 driver like the bus):
+ *
+ * $ make chksumbench.hex
+ *
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "chksum.h"
+
+#define UIP_BUFSIZE 200
+
+/* frame sizes: pong, syslog line, full frame */
+static const uint16_t sizes[] = { 8 + 5, 8 + 22, UIP_BUFSIZE - 14 - 40 };
+
+/* the chksum() main.c and icmpv6.c had before */
+static __attribute__((noinline)) uint16_t chksum_old(uint16_t sum, const uint8_t *data, uint16_t len)
+{
+  uint16_t t;
+  const uint8_t *dataptr;
+  const uint8_t *last_byte;
+
+  dataptr = data;
+  last_byte = data + len - 1;
+
+  while(dataptr < last_byte) {  /* At least two more bytes */
+    t = (dataptr[0] << 8) + dataptr[1];
+    sum += t;
+    if(sum < t) {
+      sum++;            /* carry */
+    }
+    dataptr += 2;
+  }
+
+  if(dataptr == last_byte) {
+    t = (dataptr[0] << 8) + 0;
+    sum += t;
+    if(sum < t) {
+      sum++;            /* carry */
+    }
+  }
+
+  /* Return sum in host byte order. */
+  return sum;
+}
+
+static uint8_t buf[UIP_BUFSIZE + 1];
+
+/* fills buf with a pattern which produces carries */
+static void fill(uint8_t seed) {
+    uint8_t x = seed;
+    for (uint16_t i = 0; i < sizeof(buf); i++) {
+        x = x * 73 + 41;
+        buf[i] = (i & 4) ? 0xff - (x & 0x0f) : x;
+    }
+}
+
+/* compares both implementations, returns the number of differences */
+static uint16_t check(void) {
+    static const uint16_t start[] = { 0, 1, 0x7fff, 0xfffe, 0xffff };
+    uint16_t errors = 0;
+
+    for (uint8_t seed = 0; seed < 4; seed++) {
+        fill(seed);
+        for (uint8_t s = 0; s < sizeof(start) / sizeof(start[0]); s++)
+            for (uint8_t offset = 0; offset < 2; offset++)
+                for (uint16_t len = 0; len <= UIP_BUFSIZE; len++)
+                    if (chksum(start[s], buf + offset, len) != chksum_old(start[s], buf + offset, len))
+                        errors++;
+    }
+    return errors;
+}
+
+#ifdef __AVR__
+
+#include <avr/io.h>
+
+static int uart_putchar(char c, FILE *stream) {
+    if (c == '\n')
+        uart_putchar('\r', stream);
+    while (!(UCSR0A & (1 << UDRE0)))
+        ;
+    UDR0 = c;
+    return 0;
+}
+
+static FILE uart_stdout = FDEV_SETUP_STREAM(uart_putchar, NULL, _FDEV_SETUP_WRITE);
+
+/* cycles of one call, minus the cost of reading the timer */
+#define MEASURE(call) ({                        \
+    uint16_t t0 = TCNT1;                        \
+    volatile uint16_t r = (call);               \
+    uint16_t t1 = TCNT1;                        \
+    (void)r;                                    \
+    (uint16_t)(t1 - t0 - overhead);             \
+})
+
+int main(void) {
+    /* RS485 driver on, like lib/uart.c does for sending */
+    DDRC |= (1 << PC2);
+    PORTC |= (1 << PC2);
+
+    UBRR0 = F_CPU / 16 / 38400 - 1;
+    UCSR0B = (1 << TXEN0);
+    UCSR0C = (1 << UCSZ01) | (1 << UCSZ00);
+    stdout = &uart_stdout;
+
+    /* timer 1 counts CPU cycles */
+    TCCR1A = 0;
+    TCCR1B = (1 << CS10);
+
+    uint16_t t0 = TCNT1;
+    uint16_t t1 = TCNT1;
+    uint16_t overhead = t1 - t0;
+
+    printf("chksumbench: %u differences\n", check());
+
+    fill(0);
+    for (uint8_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        uint16_t old = MEASURE(chksum_old(0, buf, sizes[i]));
+        uint16_t new = MEASURE(chksum(0, buf, sizes[i]));
+        printf("%3u bytes: old %5u cycles (%u.%02u/byte), new %5u cycles (%u.%02u/byte)\n",
+                sizes[i], old, old / sizes[i], (old % sizes[i]) * 100 / sizes[i],
+                new, new / sizes[i], (new % sizes[i]) * 100 / sizes[i]);
+    }
+
+    while (1)
+        ;
+}
+
+#else
+
+#include <stdlib.h>
+#include <time.h>
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* ns per byte of 'fn' over 'len' bytes */
+static double measure(uint16_t (*fn)(uint16_t, const uint8_t *, uint16_t), uint16_t len, unsigned long rounds) {
+    volatile uint16_t sink = 0;
+    double start = now();
+    for (unsigned long r = 0; r < rounds; r++)
+        sink += fn(r, buf, len);
+    return (now() - start) * 1e9 / rounds / len;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long rounds = (argc > 1 ? strtoul(argv[1], NULL, 0) : 2000000);
+
+    uint16_t errors = check();
+    printf("chksumbench: %u differences\n", errors);
+
+    fill(0);
+    for (uint8_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        printf("%3u bytes: old %.3f ns/byte, new %.3f ns/byte\n", sizes[i],
+                measure(chksum_old, sizes[i], rounds), measure(chksum, sizes[i], rounds));
+
+    return errors > 0;
+}
+
+#endif
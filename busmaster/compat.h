@@ -7,6 +7,11 @@
 #define PIN_CLEAR(pin) PORT_CHAR(pin ## _PORT) &= ~_BV(pin ## _PIN)
 #define PIN_SET(pin) PORT_CHAR(pin ## _PORT) |= _BV(pin ## _PIN)
 
+#define _DDR_CHAR(character) DDR ## character
+#define DDR_CHAR(character) _DDR_CHAR(character)
+
+#define DDR_CONFIG_IN(pin) DDR_CHAR(pin ## _PORT) &= ~_BV(pin ## _PIN)
+
 #define SPI_CS_HARDWARE_PORT B
 #define SPI_CS_HARDWARE_PIN 4
 #define HAVE_SPI_CS_HARDWARE 1
@@ -15,6 +20,10 @@
 #define SPI_CS_NET_PIN SPI_CS_HARDWARE_PIN
 #define HAVE_SPI_CS_NET HAVE_SPI_CS_HARDWARE
 
+/* INT output of the ENC28J60, on INT2 of the etherrape */
+#define INT_PIN_PORT B
+#define INT_PIN_PIN 2
+
 #define NET_MAX_FRAME_LENGTH 1500
 
 #define LO8(x)  ((uint8_t)(x))
@@ -22,6 +31,11 @@
 
 #define UIP_BUFSIZE 200
 
+/* UDP port of the hausbus protocol */
+#define HAUSBUS_PORT 41999
+/* UDP port for datagrams with commands for several nodes, see main.c */
+#define HAUSBUS_BATCH_PORT 41998
+
 extern uint16_t uip_len;
 extern uint16_t uip_recvlen;
 extern uint8_t uip_buf[UIP_BUFSIZE+2];
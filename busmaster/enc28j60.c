@@ -34,6 +34,7 @@
 /* global variables */
 uint8_t enc28j60_current_bank = 0;
 int16_t enc28j60_next_packet_pointer;
+uint8_t enc28j60_revision;
 
 /* module local macros */
 #ifdef RFM12_IP_SUPPORT
@@ -41,15 +42,54 @@ int16_t enc28j60_next_packet_pointer;
    we have to disable interrupts if support is enabled */
 #  define cs_low()  uint8_t sreg = SREG; cli(); PIN_CLEAR(SPI_CS_NET); 
 #  define cs_high() PIN_SET(SPI_CS_NET); SREG = sreg;
+#elif defined(MOCK)
+/* the host build models the controller behind spi_send(), see mock.c */
+void mock_enc28j60_select(void);
+void mock_enc28j60_release(void);
+#  define cs_low()  mock_enc28j60_select()
+#  define cs_high() mock_enc28j60_release()
 #else
 #  define cs_low()  PIN_CLEAR(SPI_CS_NET)
 #  define cs_high() PIN_SET(SPI_CS_NET)
 #endif
 
 
+/* Shadow copies of configuration registers the controller never changes by
+ * itself. Writing an unchanged value is skipped, reading is answered from the
+ * copy; both save the SPI transaction and maybe a bank switch. The copies
+ * are invalidated when the controller is reset.
+ *
+ * ERXRDPT is not shadowed: the controller only takes ERXRDPTL over when
+ * ERXRDPTH is written, so the high byte has to be written every time. */
+static uint8_t shadow[12];
+static uint16_t shadow_valid;
+
+static int8_t shadow_slot(uint8_t address)
+{
+    switch (address) {
+        case REG_ETXSTL:   return 0;
+        case REG_ETXSTH:   return 1;
+        case REG_ETXNDL:   return 2;
+        case REG_ETXNDH:   return 3;
+        case REG_ERXFCON:  return 4;
+        case REG_EIE:      return 5;
+        case REG_EDMASTL:  return 6;
+        case REG_EDMASTH:  return 7;
+        case REG_EDMANDL:  return 8;
+        case REG_EDMANDH:  return 9;
+        case REG_EDMADSTL: return 10;
+        case REG_EDMADSTH: return 11;
+        default:           return -1;
+    }
+}
+
 uint8_t read_control_register(uint8_t address)
 {
 
+    int8_t slot = shadow_slot(address);
+    if (slot >= 0 && (shadow_valid & (1 << slot)))
+        return shadow[slot];
+
     /* change to appropiate bank */
     if ( (address & REGISTER_ADDRESS_MASK) < KEY_REGISTERS &&
          ((address & REGISTER_BANK_MASK) >> 5) != (enc28j60_current_bank))
@@ -96,9 +136,38 @@ uint8_t read_buffer_memory(void)
 
 }
 
+void enc28j60_read_block(void *buf, uint16_t len)
+{
+
+    uint8_t *p = buf;
+
+    /* aquire device */
+    cs_low();
+
+    /* send opcode once, the read pointer auto-increments (ECON2.AUTOINC)
+     * as long as CS stays low */
+    spi_send(CMD_RBM);
+
+    /* read data */
+    while (len-- > 0)
+        *p++ = spi_send(0);
+
+    /* release device */
+    cs_high();
+
+}
+
 void write_control_register(uint8_t address, uint8_t data)
 {
 
+    int8_t slot = shadow_slot(address);
+    if (slot >= 0) {
+        if ((shadow_valid & (1 << slot)) && shadow[slot] == data)
+            return;
+        shadow[slot] = data;
+        shadow_valid |= (1 << slot);
+    }
+
     /* change to appropiate bank */
     if ( (address & REGISTER_ADDRESS_MASK) < KEY_REGISTERS &&
          ((address & REGISTER_BANK_MASK) >> 5) != (enc28j60_current_bank))
@@ -135,9 +204,37 @@ void write_buffer_memory(uint8_t data)
 
 }
 
+void enc28j60_write_block(const void *buf, uint16_t len)
+{
+
+    const uint8_t *p = buf;
+
+    /* aquire device */
+    cs_low();
+
+    /* send opcode once, see enc28j60_read_block() */
+    spi_send(CMD_WBM);
+
+    /* send data */
+    while (len-- > 0)
+        spi_send(*p++);
+
+    /* release device */
+    cs_high();
+
+}
+
 void bit_field_modify(uint8_t address, uint8_t mask, uint8_t opcode)
 {
 
+    int8_t slot = shadow_slot(address);
+    if (slot >= 0 && (shadow_valid & (1 << slot))) {
+        uint8_t data = (opcode == CMD_BFS ? shadow[slot] | mask : shadow[slot] & ~mask);
+        if (data == shadow[slot])
+            return;
+        shadow[slot] = data;
+    }
+
     /* change to appropiate bank */
     if ( (address & REGISTER_ADDRESS_MASK) < KEY_REGISTERS &&
          ((address & REGISTER_BANK_MASK) >> 5) != (enc28j60_current_bank))
@@ -218,6 +315,40 @@ void write_phy(uint8_t address, uint16_t data)
 
 }
 
+void enc28j60_copy(uint16_t start, uint16_t end, uint16_t destination)
+{
+
+    write_control_register(REG_EDMASTL, LO8(start));
+    write_control_register(REG_EDMASTH, HI8(start));
+    write_control_register(REG_EDMANDL, LO8(end));
+    write_control_register(REG_EDMANDH, HI8(end));
+    write_control_register(REG_EDMADSTL, LO8(destination));
+    write_control_register(REG_EDMADSTH, HI8(destination));
+
+    /* start the DMA in copy mode and wait for it to finish */
+    bit_field_set(REG_ECON1, _BV(ECON1_DMAST));
+    while (read_control_register(REG_ECON1) & _BV(ECON1_DMAST));
+
+}
+
+uint16_t enc28j60_checksum(uint16_t start, uint16_t end)
+{
+
+    write_control_register(REG_EDMASTL, LO8(start));
+    write_control_register(REG_EDMASTH, HI8(start));
+    write_control_register(REG_EDMANDL, LO8(end));
+    write_control_register(REG_EDMANDH, HI8(end));
+
+    /* start the DMA in checksum mode and wait for it to finish */
+    bit_field_set(REG_ECON1, _BV(ECON1_CSUMEN) | _BV(ECON1_DMAST));
+    while (read_control_register(REG_ECON1) & _BV(ECON1_DMAST));
+    bit_field_clear(REG_ECON1, _BV(ECON1_CSUMEN));
+
+    /* EDMACSH is the first byte of the checksum in the packet */
+    return (read_control_register(REG_EDMACSH) << 8) | read_control_register(REG_EDMACSL);
+
+}
+
 void reset_controller(void)
 {
     uint8_t i;
@@ -235,6 +366,10 @@ void reset_controller(void)
 
         i = read_control_register(REG_ESTAT);
     } while ((i & 0x08) || (~i & _BV(CLKRDY)));
+
+    /* the reset selected bank 0 and set all registers to their defaults */
+    enc28j60_current_bank = 0;
+    shadow_valid = 0;
 }
 
 void reset_rx(void)
@@ -250,11 +385,38 @@ void reset_rx(void)
 
 }
 
+/* The hash table filter uses bits 28:23 of the Ethernet CRC over the
+ * destination MAC as index into EHT0-EHT7. */
+static uint8_t hash_table_bit(const uint8_t *mac)
+{
+    uint32_t crc = 0xffffffff;
+
+    for (uint8_t i = 0; i < 6; i++) {
+        crc ^= mac[i];
+        for (uint8_t b = 0; b < 8; b++)
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+    }
+
+    return (~crc >> 23) & 0x3f;
+}
+
+static const uint8_t groups[] = { ENC28J60_FILTER_GROUPS };
+
+bool enc28j60_group(uint8_t group)
+{
+    for (uint8_t i = 0; i < sizeof(groups); i++)
+        if (groups[i] == group)
+            return true;
+    return false;
+}
+
 void init_enc28j60(void)
 {
 
     reset_controller();
 
+    enc28j60_revision = read_control_register(REG_EREVID);
+
     /* set receive buffer to span from 0 to 4kb */
     write_control_register(REG_ERXSTL, LO8(RXBUFFER_START));
     write_control_register(REG_ERXSTH, HI8(RXBUFFER_START));
@@ -308,8 +470,32 @@ void init_enc28j60(void)
     write_control_register(REG_MAADR1, 0x00);
     write_control_register(REG_MAADR0, 0x00);
 
-    /* receive broadcast, multicast and unicast packets */
-    write_control_register(REG_ERXFCON, _BV(BCEN) | _BV(MCEN) | _BV(UCEN));
+    /* pattern match: destination MAC 33:33:ff:00:00:xx, the solicited-node
+     * multicasts of fd1a:56e6:97e9:0:b5:ff:fe00:xx which handle_icmpv6()
+     * answers, i.e. the first five bytes with their IP checksum */
+    write_control_register(REG_EPMOL, 0);
+    write_control_register(REG_EPMOH, 0);
+    write_control_register(REG_EPMM0, 0x1F);
+    for (uint8_t i = 1; i < 8; i++)
+        write_control_register(REG_EPMM0 + i, 0);
+    write_control_register(REG_EPMCSL, 0xcb);   /* ~(0x3333 + 0xff00 + 0x0000) */
+    write_control_register(REG_EPMCSH, 0xcd);
+
+    /* hash table: 33:33:00:b5:00:xx (ff05::b5:xx) of the groups we forward,
+     * only a few buckets are set */
+    uint8_t table[8] = { 0 };
+    uint8_t mac[6] = { 0x33, 0x33, 0x00, 0xb5, 0x00, 0x00 };
+    for (uint8_t i = 0; i < sizeof(groups); i++) {
+        mac[5] = groups[i];
+        uint8_t bit = hash_table_bit(mac);
+        table[bit >> 3] |= _BV(bit & 7);
+    }
+    for (uint8_t i = 0; i < 8; i++)
+        write_control_register(REG_EHT0 + i, table[i]);
+
+    /* receive only those and unicast packets, no broadcasts, drop frames
+     * with a bad CRC */
+    write_control_register(REG_ERXFCON, RXFILTER);
 
     /* configure leds: led a link status and receive activity, led b transmit activity */
     write_phy(PHY_PHLCON, _BV(STRCH) | _BV(LACFG3) | _BV(LACFG2) | _BV(LBCFG0));
@@ -319,9 +505,20 @@ void init_enc28j60(void)
     /* do additional steps to enable link change interrupt */
     write_phy(PHY_PHIE, _BV(PGEIE) | _BV(PLINKIE));
 
+#ifndef ENC28J60_POLL
+    /* INT is active low and stays low while a flag is pending: INT2 is level
+     * triggered, the handler masks it until network_process() is done */
+    DDR_CONFIG_IN(INT_PIN);
+    EICRA &= ~(_BV(ISC21) | _BV(ISC20));
+    EIMSK |= _BV(INT2);
+#endif
+
     /* set phy to half-duplex */
     write_phy(PHY_PHCON1, 0x0000);
 
+    /* do not receive our own frames in half-duplex mode */
+    write_phy(PHY_PHCON2, _BV(HDLDIS));
+
     /* set filters */
 
     /* enable receiver */
@@ -330,13 +527,23 @@ void init_enc28j60(void)
     /* set auto-increment bit */
     bit_field_set(REG_ECON2, _BV(AUTOINC));
 
+    /* frames queued before the reset are gone */
+    enc28j60_transmit_init();
+
 }
 
 void switch_bank(uint8_t bank)
 {
 
-    bit_field_clear(REG_ECON1, _BV(ECON1_BSEL0) | _BV(ECON1_BSEL1));
-    bit_field_set(REG_ECON1, (bank & BANK_MASK));
+    /* only touch the bank select bits which differ, switching between
+     * neighbouring banks (0 and 1, 2 and 3) is a single operation */
+    uint8_t clear = enc28j60_current_bank & ~bank & BANK_MASK;
+    uint8_t set = bank & ~enc28j60_current_bank & BANK_MASK;
+
+    if (clear)
+        bit_field_clear(REG_ECON1, clear);
+    if (set)
+        bit_field_set(REG_ECON1, set);
 
     enc28j60_current_bank = bank;
 
@@ -27,6 +27,7 @@
 #define _ENC28J60_H
 
 #include <avr/io.h>
+#include <stdbool.h>
 
 #define noinline __attribute__((noinline))
 
@@ -281,12 +282,31 @@
 #define RXBUFFER_START 0x0000   /* start receive buffer at the beginning */
 #define RXBUFFER_END   0x0FFF   /* end receive buffer at 4kb */
 #define TXBUFFER_START 0x1000   /* start transmit buffer at 4kb */
+#define TXBUFFER_TEMPLATE (TXBUFFER_START)          /* resident UDP header, see transmit_udp_packet() */
+#define TXBUFFER_SLOTS    (TXBUFFER_START + 0x100)  /* queued frames, up to the end of the memory */
+#define TX_SLOT_SIZE      0x100                     /* control byte, frame, transmit status vector */
+
+/* receive filter: our unicast MAC, the solicited-node MACs 33:33:ff:00:00:xx
+ * of the bus addresses (pattern match) and the MACs of the groups in
+ * ENC28J60_FILTER_GROUPS (hash table), see init_enc28j60(). The groups are
+ * those whose frames from other segments go onto this bus, as a list for
+ * an array initializer; the default is the message group of the pinpads.
+ * The hash table lets through some other multicasts as well, see
+ * enc28j60_group(). */
+#define RXFILTER (_BV(UCEN) | _BV(PMEN) | _BV(HTEN) | _BV(CRCEN))
+#ifndef ENC28J60_FILTER_GROUPS
+#define ENC28J60_FILTER_GROUPS 50
+#endif
 
 #define RECEIVE_BUFFER_WRAP(x) ((x) & (RXBUFFER_END))
 
 /* global variables */
 extern int16_t enc28j60_next_packet_pointer;
 
+/* EREVID, read by init_enc28j60(); errata workarounds depend on it */
+extern uint8_t enc28j60_revision;
+#define ENC28J60_REV_B7 0x06
+
 /* do not do timeout while waiting for spi transfer completed */
 /* #define SPI_TIMEOUT */
 
@@ -308,6 +328,8 @@ uint8_t noinline read_control_register(uint8_t address);
 uint8_t noinline read_buffer_memory(void);
 void noinline write_control_register(uint8_t address, uint8_t data);
 void noinline write_buffer_memory(uint8_t data);
+void noinline enc28j60_read_block(void *buf, uint16_t len);
+void noinline enc28j60_write_block(const void *buf, uint16_t len);
 void noinline bit_field_modify(uint8_t address, uint8_t mask, uint8_t opcode);
 void noinline set_read_buffer_pointer(uint16_t address);
 uint16_t noinline get_read_buffer_pointer(void);
@@ -315,15 +337,53 @@ void noinline set_write_buffer_pointer(uint16_t address);
 uint16_t noinline get_write_buffer_pointer(void);
 uint16_t noinline read_phy(uint8_t address);
 void noinline write_phy(uint8_t address, uint16_t data);
+uint16_t noinline enc28j60_checksum(uint16_t start, uint16_t end);
+void noinline enc28j60_copy(uint16_t start, uint16_t end, uint16_t destination);
 void noinline reset_controller(void);
 void noinline reset_rx(void);
 void init_enc28j60(void);
+/* true if 'group' is one of ENC28J60_FILTER_GROUPS */
+bool enc28j60_group(uint8_t group);
 void enc28j60_periodic(void);
 void noinline switch_bank(uint8_t bank);
 void network_config_load(void);
 
 void network_process(void);
 void transmit_packet(void);
+#ifdef ENC28J60_CHECKSUM_OFFLOAD
+/* Like transmit_packet(), but the controller calculates the UDP or ICMPv6
+ * checksum over the IPv6 addresses and payload; 'pseudo' is the rest of the
+ * pseudo header (payload length + next header), the checksum field at
+ * 'offset' must be zero. */
+void transmit_packet_checksum(uint8_t offset, uint16_t pseudo);
+#endif
+
+/* Sends uip_buf like transmit_packet(), for the UDP multicast frames built
+ * in main.c: their header stays resident in the controller and only the
+ * header bytes which changed since the last frame go over SPI, followed by
+ * UDP length, checksum and payload. With ENC28J60_CHECKSUM_OFFLOAD, the
+ * controller also calculates the UDP checksum. */
+void transmit_udp_packet(void);
+
+/* frames are queued in the transmit buffer, network_process() calls
+ * enc28j60_transmit_done() on TXIF to send the next one, 'error' is set if
+ * the transmission was aborted (TXERIF) */
+void enc28j60_transmit_init(void);
+void enc28j60_transmit_done(bool error);
+extern bool enc28j60_tx_busy;
+extern uint16_t enc28j60_tx_dropped;
+
+/* true if the next transmit_*() call will not have to drop its frame */
+bool enc28j60_transmit_ready(void);
+
+#ifndef ENC28J60_POLL
+/* set by the INT2 interrupt when the controller pulls its INT line low,
+ * network_process() only talks to the controller when it is set */
+extern volatile bool enc28j60_interrupt;
+#define enc28j60_pending() (enc28j60_interrupt)
+#else
+#define enc28j60_pending() (false)
+#endif
 
 #ifdef DEBUG_ENC28J60
 void dump_debug_registers(void);
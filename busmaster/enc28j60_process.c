@@ -24,18 +24,29 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <avr/pgmspace.h>
+#include <avr/interrupt.h>
 
 #include "enc28j60.h"
 #include "compat.h"
 
-/*FIXME: interrupts not supported */
-#define ENC28J60_POLL
+/* Without ENC28J60_POLL, the controller reports through its INT line (see
+ * init_enc28j60()) and network_process() does not use SPI until it did. As
+ * PKTIF is not reliable (errata #6), EPKTCNT is still read every
+ * ENC28J60_FALLBACK_POLL calls. With ENC28J60_POLL, EPKTCNT is read on
+ * every call. */
+#ifndef ENC28J60_FALLBACK_POLL
+#define ENC28J60_FALLBACK_POLL 100
+#endif
+
 #ifndef ENC28J60_POLL
-    #define interrupt_occured() (! PIN_HIGH(INT_PIN))
-    #define wol_interrupt_occured() (! PIN_HIGH(WOL_PIN))
-#else
-    #define interrupt_occured() 1
-    #define wol_interrupt_occured() 0
+volatile bool enc28j60_interrupt;
+
+ISR(INT2_vect)
+{
+    enc28j60_interrupt = true;
+    /* INT stays low until network_process() cleared the flags */
+    EIMSK &= ~_BV(INT2);
+}
 #endif
 
 /* prototypes */
@@ -68,25 +79,38 @@ static void debug_printf(const char *fmt, ...) {
 
 void network_process(void)
 {
+#ifndef ENC28J60_POLL
+    static uint8_t fallback;
+
+    bool interrupted = enc28j60_interrupt;
+    if (!interrupted && ++fallback < ENC28J60_FALLBACK_POLL)
+        return;
+    fallback = 0;
+    enc28j60_interrupt = false;
+#endif
+
     /* also check packet counter, see errata #6 */
     uint8_t pktcnt = read_control_register(REG_EPKTCNT);
 
-    /* if no interrupt occured and no packets are in the receive
-     * buffer, return */
-    if ( !interrupt_occured() || pktcnt == 0)
+#ifndef ENC28J60_POLL
+    /* the fallback poll found nothing, the interrupt is still enabled */
+    if (!interrupted && pktcnt == 0)
         return;
+#else
+    /* if no packets are in the receive buffer and no transmission is
+     * waiting for TXIF, return */
+    if (pktcnt == 0 && !enc28j60_tx_busy)
+        return;
+#endif
 
-#   if defined(ENC28J60_REV4_WORKAROUND) && defined(DEBUG_REV4_WORKAROUND)
-    if (pktcnt > 5)
+#   if defined(DEBUG_REV4_WORKAROUND)
+    if (enc28j60_revision < ENC28J60_REV_B7 && pktcnt > 5)
         debug_printf("net: BUG: pktcnt > 5\n");
 #   endif
 
     /* read interrupt register */
     uint8_t EIR = read_control_register(REG_EIR);
 
-    /* clear global interrupt flag */
-    bit_field_clear(REG_EIE, _BV(INTIE));
-
 #ifdef DEBUG_INTERRUPT
     /* check if some interrupts occured */
     if (EIR != 0) {
@@ -130,22 +154,28 @@ void network_process(void)
 			}
     }
 
-    /* packet transmit flag */
-    if (EIR & _BV(TXIF)) {
+    /* packet transmit flag, transmit error flag: an aborted transmission
+     * sets both, it must only finish the frame once */
+    if (EIR & (_BV(TXIF) | _BV(TXERIF))) {
 
 #ifdef DEBUG
         uint8_t ESTAT = read_control_register(REG_ESTAT);
 
         if (ESTAT & _BV(TXABRT))
             debug_printf(PSTR("net: packet transmit failed\n"));
+        if (EIR & _BV(TXERIF))
+            debug_printf(PSTR("net: transmit error!\n"));
 #endif
         /* clear flags */
-        bit_field_clear(REG_EIR, _BV(TXIF));
+        bit_field_clear(REG_EIR, _BV(TXIF) | _BV(TXERIF));
         bit_field_clear(REG_ESTAT, _BV(TXABRT) | _BV(LATECOL) );
+
+        /* send the next queued frame */
+        enc28j60_transmit_done(EIR & _BV(TXERIF));
     }
 
     /* packet receive flag */
-    if (EIR & _BV(PKTIF) || pktcnt > 0) {
+    if (pktcnt > 0) {
 #if 0
       if (uip_buf_lock ())
 	return;			/* already locked */
@@ -165,63 +195,91 @@ void network_process(void)
 
         bit_field_clear(REG_EIR, _BV(RXERIF));
 
-#ifdef ENC28J60_REV4_WORKAROUND
-        init_enc28j60();
-#endif
+        /* start over on revisions before B7, see the errata */
+        if (enc28j60_revision < ENC28J60_REV_B7)
+            init_enc28j60();
 
     }
 
-    /* transmit error */
-    if (EIR & _BV(TXERIF)) {
-#ifdef DEBUG
-        debug_printf(PSTR("net: transmit error!\n"));
+#ifndef ENC28J60_POLL
+    /* fires again right away if INT is still low, e.g. when more frames
+     * are waiting */
+    EIMSK |= _BV(INT2);
 #endif
+}
 
-        bit_field_clear(REG_EIR, _BV(TXERIF));
-    }
 
-    /* set global interrupt flag */
-    bit_field_set(REG_EIE, _BV(INTIE));
-}
+/* Decides from the first PEEK_LEN bytes (Ethernet, IPv6 and the first 8
+ * bytes of ICMPv6/UDP) whether the busmaster does anything with a frame:
+ * neighbor solicitations and echo requests (see handle_icmpv6()) and UDP to
+ * HAUSBUS_PORT or HAUSBUS_BATCH_PORT. Everything else is skipped without
+ * reading it. */
+#define PEEK_LEN (14 + 40 + 8)
 
+static bool frame_wanted(const uint8_t *frame)
+{
+    /* ethernet type must be IPv6 */
+    if (frame[12] != 0x86 || frame[13] != 0xdd)
+        return false;
+
+    switch (frame[20]) {
+    case 0x3a:
+        /* neighbor solicitation or echo request */
+        return frame[54] == 0x87 || frame[54] == 0x80;
+    case 0x11:
+        /* UDP destination port */
+        return (frame[56] == HI8(HAUSBUS_PORT) && frame[57] == LO8(HAUSBUS_PORT)) ||
+            (frame[56] == HI8(HAUSBUS_BATCH_PORT) && frame[57] == LO8(HAUSBUS_BATCH_PORT));
+    default:
+        return false;
+    }
+}
 
+/* Only called by network_process() after it has seen EPKTCNT > 0. Does not
+ * read EPKTCNT again: that is the only bank 1 register on the receive path,
+ * everything here is in bank 0 or common. */
 void process_packet(void)
 {
-    /* if there is a packet to process */
-    if (read_control_register(REG_EPKTCNT) == 0)
-        return;
-
     /* read next packet pointer */
     set_read_buffer_pointer(enc28j60_next_packet_pointer);
-    enc28j60_next_packet_pointer = read_buffer_memory() | (read_buffer_memory() << 8);
 
-    /* read receive status vector */
-    struct receive_packet_vector_t rpv;
-    uint8_t *p = (uint8_t *)&rpv;
+    /* read next packet pointer and receive status vector in one go */
+    struct {
+        uint8_t next_packet_pointer[2];
+        struct receive_packet_vector_t rpv;
+    } __attribute__((packed)) header;
 
-    for (uint8_t i = 0; i < sizeof(struct receive_packet_vector_t); i++)
-        *p++ = read_buffer_memory();
+    enc28j60_read_block(&header, sizeof(header));
+    enc28j60_next_packet_pointer = header.next_packet_pointer[0] | (header.next_packet_pointer[1] << 8);
+    struct receive_packet_vector_t rpv = header.rpv;
 
     /* decrement rpv received_packet_size by 4, because the 4 byte CRC checksum is counted */
     rpv.received_packet_size -= 4;
 
-    /* check size */
+    /* a size the MAC can not have received means the receive buffer is
+     * corrupted, start over */
     if (rpv.received_packet_size > NET_MAX_FRAME_LENGTH
-            || rpv.received_packet_size < 14
-            || rpv.received_packet_size > UIP_BUFSIZE) {
+            || rpv.received_packet_size < 14) {
 #       ifdef DEBUG
         debug_printf(PSTR("net: packet too large or too small for an "
 		     "ethernet header: %d\n"), rpv.received_packet_size);
 #       endif
         init_enc28j60();
-	//goto skip;
         return;
     }
 
-    /* read packet */
-    p = uip_recvbuf;
-    for (uint16_t i = 0; i < rpv.received_packet_size; i++)
-        *p++ = read_buffer_memory();
+    /* frames which do not fit into uip_recvbuf or are too short for
+     * anything we handle are dropped by just advancing ERXRDPT */
+    if (rpv.received_packet_size > UIP_BUFSIZE
+            || rpv.received_packet_size < PEEK_LEN)
+        goto skip;
+
+    /* read the headers, then the rest only if we are interested */
+    enc28j60_read_block(uip_recvbuf, PEEK_LEN);
+    if (!frame_wanted(uip_recvbuf))
+        goto skip;
+
+    enc28j60_read_block(uip_recvbuf + PEEK_LEN, rpv.received_packet_size - PEEK_LEN);
 
     uip_recvlen = rpv.received_packet_size;
 
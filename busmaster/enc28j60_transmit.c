@@ -21,57 +21,259 @@
  */
 
 #include <string.h>
+#include <stdbool.h>
 #include <avr/pgmspace.h>
 
 #include "enc28j60.h"
 #include "compat.h"
 
 
-void transmit_packet(void)
+/*
+ * Frames are not sent from uip_buf directly: they are copied into a ring of
+ * slots in the transmit buffer and sent one after the other. The next one is
+ * launched when network_process() sees TXIF for the previous one, so nobody
+ * waits for the controller to finish a transmission.
+ */
+#define TX_SLOTS ((0x2000 - TXBUFFER_SLOTS) / TX_SLOT_SIZE)
+
+static uint8_t slot_len[TX_SLOTS];
+/* oldest queued frame, being transmitted if enc28j60_tx_busy is set */
+static uint8_t slot_head;
+static uint8_t slot_count;
+
+bool enc28j60_tx_busy;
+uint16_t enc28j60_tx_dropped;
+/* a transmission was aborted, the transmit logic may stall (errata #12) */
+static bool tx_reset;
+
+/* Copy of the header bytes resident in the template area, the first
+ * TEMPLATE_LEN bytes of the frames transmit_udp_packet() sends. */
+#define TEMPLATE_LEN 58
+static uint8_t resident[TEMPLATE_LEN];
+static bool template_valid;
+
+static uint16_t slot_address(uint8_t slot)
 {
-    /* wait for any transmits to end, with timeout */
-    uint8_t timeout = 100;
-    while (read_control_register(REG_ECON1) & _BV(ECON1_TXRTS) && timeout-- > 0);
+    return TXBUFFER_SLOTS + slot * TX_SLOT_SIZE;
+}
 
-    if (timeout == 0) {
-#if 0
-        debug_printf("net: timeout waiting for TXRTS, aborting transmit!\n");
-#endif
+/* sends the 'len' bytes frame at 'start' */
+static void start_transmission(uint16_t start, uint8_t len)
+{
+    /* set send control registers */
+    write_control_register(REG_ETXSTL, LO8(start));
+    write_control_register(REG_ETXSTH, HI8(start));
+
+    write_control_register(REG_ETXNDL, LO8(start + len));
+    write_control_register(REG_ETXNDH, HI8(start + len));
+
+    /* reset transmit hardware, see errata #12: before every frame on
+     * revisions before B7, after an aborted transmission on newer ones */
+    if (enc28j60_revision < ENC28J60_REV_B7 || tx_reset) {
+        bit_field_set(REG_ECON1, _BV(ECON1_TXRST));
+        bit_field_clear(REG_ECON1, _BV(ECON1_TXRST));
+        tx_reset = false;
+    }
+
+    /* transmit packet; our own frames are not received again, half duplex
+     * loopback is disabled in init_enc28j60() */
+    bit_field_set(REG_ECON1, _BV(ECON1_TXRTS));
+}
+
+static void launch(void)
+{
+    start_transmission(slot_address(slot_head), slot_len[slot_head]);
+    enc28j60_tx_busy = true;
+}
+
+void enc28j60_transmit_done(bool error)
+{
+    if (!enc28j60_tx_busy)
         return;
+
+    if (error)
+        tx_reset = true;
+
+    enc28j60_tx_busy = false;
+    slot_head = (slot_head + 1) % TX_SLOTS;
+    slot_count--;
+
+    if (slot_count > 0)
+        launch();
+}
+
+void enc28j60_transmit_init(void)
+{
+    slot_head = 0;
+    slot_count = 0;
+    enc28j60_tx_busy = false;
+    template_valid = false;
+    tx_reset = false;
+}
+
+/* frees the slot of the frame in flight if it went out, network_process()
+ * may not have seen its TXIF yet. Both flags are cleared as there: a
+ * TXERIF left behind would finish the next frame while it is sent. */
+static void poll_transmission(void)
+{
+    if (!(read_control_register(REG_ECON1) & _BV(ECON1_TXRTS))) {
+        uint8_t eir = read_control_register(REG_EIR);
+        bit_field_clear(REG_EIR, _BV(TXIF) | _BV(TXERIF));
+        bit_field_clear(REG_ESTAT, _BV(TXABRT) | _BV(LATECOL));
+        enc28j60_transmit_done(eir & _BV(TXERIF));
     }
+}
 
-    /* disable multicast packets to not receive our broadcast packets again */
-    write_control_register(REG_ERXFCON, _BV(UCEN));
+bool enc28j60_transmit_ready(void)
+{
+    if (slot_count == TX_SLOTS)
+        poll_transmission();
 
-    uint16_t start_pointer = TXBUFFER_START;
+    return slot_count < TX_SLOTS;
+}
 
-    /* set send control registers */
-    write_control_register(REG_ETXSTL, LO8(start_pointer));
-    write_control_register(REG_ETXSTH, HI8(start_pointer));
+/* returns the address of the next free slot, 0 if all stay queued */
+static uint16_t reserve_slot(void)
+{
+    /* All slots are queued, the CPU writes frames faster than they go out
+     * at 10 MBit/s. Wait for the frame in flight, with the timeout
+     * transmit_packet() always had. */
+    uint8_t timeout = 100;
+    while (slot_count == TX_SLOTS && timeout-- > 0)
+        poll_transmission();
 
-    write_control_register(REG_ETXNDL, LO8(start_pointer + uip_len));
-    write_control_register(REG_ETXNDH, HI8(start_pointer + uip_len));
+    if (slot_count == TX_SLOTS) {
+        enc28j60_tx_dropped++;
+        return 0;
+    }
+
+    return slot_address((slot_head + slot_count) % TX_SLOTS);
+}
+
+/* queues the frame written to the reserved slot, sends it if the
+ * controller is idle */
+static void queue_slot(void)
+{
+    slot_len[(slot_head + slot_count) % TX_SLOTS] = uip_len;
+    slot_count++;
 
+    if (!enc28j60_tx_busy)
+        launch();
+}
+
+/* copies uip_buf to 'start' in the transmit buffer */
+static void write_packet(uint16_t start)
+{
     /* set pointer to beginning of tx buffer */
-    set_write_buffer_pointer(start_pointer);
+    set_write_buffer_pointer(start);
 
     /* write override byte */
     write_buffer_memory(0);
 
     /* write data */
-    for (uint16_t i = 0; i < uip_len; i++) {
-        write_buffer_memory(uip_buf[i]);
+    enc28j60_write_block(uip_buf, uip_len);
+}
+
+/* Brings the header in the template area up to date, only writing the
+ * bytes which differ from the resident ones, and copies it (with the
+ * control byte in front) to 'start' with the DMA engine. Then writes UDP
+ * length, checksum and payload behind it. */
+static void write_template_packet(uint16_t start)
+{
+    if (!template_valid) {
+        set_write_buffer_pointer(TXBUFFER_TEMPLATE);
+        write_buffer_memory(0);
+        enc28j60_write_block(uip_buf, TEMPLATE_LEN);
+        memcpy(resident, uip_buf, TEMPLATE_LEN);
+        template_valid = true;
+    } else {
+        /* the template does not cross a 256 byte boundary, only the low
+         * byte of the write pointer changes */
+        write_control_register(REG_EWRPTH, HI8(TXBUFFER_TEMPLATE + 1));
+
+        uint8_t i = 0;
+        while (i < TEMPLATE_LEN) {
+            if (uip_buf[i] == resident[i]) {
+                i++;
+                continue;
+            }
+
+            uint8_t run = i;
+            while (i < TEMPLATE_LEN && uip_buf[i] != resident[i]) {
+                resident[i] = uip_buf[i];
+                i++;
+            }
+
+            write_control_register(REG_EWRPTL, LO8(TXBUFFER_TEMPLATE + 1 + run));
+            enc28j60_write_block(uip_buf + run, i - run);
+        }
     }
 
-#   ifdef ENC28J60_REV4_WORKAROUND
-    /* reset transmit hardware, see errata #12 */
-    bit_field_set(REG_ECON1, _BV(ECON1_TXRST));
-    bit_field_clear(REG_ECON1, _BV(ECON1_TXRST));
-#   endif
+    enc28j60_copy(TXBUFFER_TEMPLATE, TXBUFFER_TEMPLATE + TEMPLATE_LEN, start);
 
-    /* transmit packet */
-    bit_field_set(REG_ECON1, _BV(ECON1_TXRTS));
+    /* UDP length, checksum and payload */
+    set_write_buffer_pointer(start + 1 + TEMPLATE_LEN);
+    enc28j60_write_block(uip_buf + TEMPLATE_LEN, uip_len - TEMPLATE_LEN);
+}
+
+#ifdef ENC28J60_CHECKSUM_OFFLOAD
+/* Lets the controller calculate the UDP or ICMPv6 checksum of the frame at
+ * 'start' with its DMA engine: over the IPv6 source and destination address
+ * and the IPv6 payload. 'pseudo' is the rest of the pseudo header (payload
+ * length and next header). The checksum field at 'offset' must be zero. */
+static void checksum_packet(uint16_t start, uint8_t offset, uint16_t pseudo)
+{
+    /* frame byte i is at start + 1, behind the control byte */
+    uint16_t from = start + 1 + 22;
+    uint16_t to = start + 1 + 54 + ((uip_buf[18] << 8) | uip_buf[19]) - 1;
+
+    /* undo the final complement and add the pseudo header */
+    uint16_t sum = ~enc28j60_checksum(from, to);
+    sum += pseudo;
+    if (sum < pseudo)
+        sum++;
+    sum = ~sum;
+    if (sum == 0)
+        sum = 0xffff;
 
-    /* re-enable multicast packets */
-    write_control_register(REG_ERXFCON, _BV(BCEN) | _BV(MCEN) | _BV(UCEN));
+    uint8_t checksum[2] = { HI8(sum), LO8(sum) };
+    set_write_buffer_pointer(start + 1 + offset);
+    enc28j60_write_block(checksum, sizeof(checksum));
 }
+#endif
+
+void transmit_packet(void)
+{
+    uint16_t start = reserve_slot();
+    if (start == 0)
+        return;
+
+    write_packet(start);
+    queue_slot();
+}
+
+void transmit_udp_packet(void)
+{
+    uint16_t start = reserve_slot();
+    if (start == 0)
+        return;
+
+    write_template_packet(start);
+#ifdef ENC28J60_CHECKSUM_OFFLOAD
+    checksum_packet(start, 60, ((uip_buf[18] << 8) | uip_buf[19]) + 17);
+#endif
+    queue_slot();
+}
+
+#ifdef ENC28J60_CHECKSUM_OFFLOAD
+void transmit_packet_checksum(uint8_t offset, uint16_t pseudo)
+{
+    uint16_t start = reserve_slot();
+    if (start == 0)
+        return;
+
+    write_packet(start);
+    checksum_packet(start, offset, pseudo);
+    queue_slot();
+}
+#endif
@@ -0,0 +1,203 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * Per-node statistics of the bus, published as a binary UDP datagram on
+ * ff05::b5:fe every HEALTH_REPORT_S seconds.
+ *
+ * A datagram holds at most 10 nodes, the table is split up if necessary.
+ * Nodes which never sent a frame and never got a command are left out.
+ * All values are big endian:
+ *
+ *   header   0     version (1)
+ *            1     number of records
+ *            2-5   uptime in seconds
+ *            6-7   header checksum errors outside of an answer window
+ *
+ *   record   0     node address
+ *            1     seconds since the last frame of the node (up to 255)
+ *            2     pong round trip time, EWMA in 1/8 ms (up to 255)
+ *            3     pong round trip time, maximum in ms
+ *            4-5   header checksum errors while the node was expected
+ *                  to answer
+ *            6-7   pings and sendreqs the node did not answer
+ *            8-9   frames from the node to Ethernet
+ *            10-11 frames from Ethernet to the node
+ *
+ * Counters wrap around. The round trip time is measured from the start of
+ * the ping to the complete pong.
+ *
+ */
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "health.h"
+#include "poll.h"
+
+#define HEALTH_VERSION 1
+#define RECORDS_PER_DATAGRAM 10
+
+/* extra time before an answer counts as missing, on top of the maximum
+ * round trip time */
+#define TIMEOUT_MARGIN_MS 2
+
+#define NODES (POLL_LAST_NODE - POLL_FIRST_NODE + 1)
+
+static struct {
+    uint32_t last_seen;
+    uint16_t asked_at;
+    /* EWMA in 1/64 ms, reported in 1/8 ms */
+    uint16_t rtt_avg;
+    uint8_t rtt_max;
+    bool asked;
+    bool known;
+    uint16_t crc_errors;
+    uint16_t timeouts;
+    uint16_t frames_up;
+    uint16_t frames_down;
+} nodes[NODES];
+
+static uint16_t crc_errors;
+/* node which was asked last and its answer window */
+static uint8_t last_asked;
+static uint16_t window_end;
+
+static uint32_t seconds;
+static uint16_t second_at;
+static uint16_t report_in = HEALTH_REPORT_S;
+/* next node to report, 0 if no report is in progress */
+static uint8_t report_node;
+
+static bool valid(uint8_t node) {
+    return node >= POLL_FIRST_NODE && node <= POLL_LAST_NODE;
+}
+
+void health_request(uint8_t node, uint16_t now, uint8_t wait) {
+    last_asked = 0;
+    if (!valid(node))
+        return;
+
+    uint8_t i = node - POLL_FIRST_NODE;
+    if (nodes[i].asked)
+        nodes[i].timeouts++;
+    nodes[i].asked = true;
+    nodes[i].asked_at = now;
+    last_asked = node;
+    window_end = now + wait;
+}
+
+void health_frame(uint8_t node, bool pong, uint16_t now) {
+    if (!valid(node))
+        return;
+
+    uint8_t i = node - POLL_FIRST_NODE;
+    nodes[i].last_seen = seconds;
+    nodes[i].known = true;
+    nodes[i].frames_up++;
+
+    if (!nodes[i].asked)
+        return;
+    nodes[i].asked = false;
+    if (last_asked == node)
+        last_asked = 0;
+
+    /* a send is answered with a frame of any length, only pongs tell the
+     * round trip time */
+    if (!pong)
+        return;
+
+    uint16_t rtt = now - nodes[i].asked_at;
+    if (rtt > 255)
+        rtt = 255;
+    if (rtt > nodes[i].rtt_max)
+        nodes[i].rtt_max = rtt;
+    if (nodes[i].rtt_avg == 0)
+        nodes[i].rtt_avg = rtt << 6;
+    else nodes[i].rtt_avg += ((int16_t)(rtt << 6) - (int16_t)nodes[i].rtt_avg) / 8;
+}
+
+void health_crc_error(uint16_t now) {
+    if (last_asked != 0 && (int16_t)(window_end - now) >= 0) {
+        nodes[last_asked - POLL_FIRST_NODE].crc_errors++;
+        nodes[last_asked - POLL_FIRST_NODE].known = true;
+    } else {
+        crc_errors++;
+    }
+}
+
+void health_command(uint8_t node) {
+    if (!valid(node))
+        return;
+
+    nodes[node - POLL_FIRST_NODE].frames_down++;
+    nodes[node - POLL_FIRST_NODE].known = true;
+}
+
+uint8_t health_timeout(uint8_t node, uint8_t limit) {
+    if (!valid(node))
+        return limit;
+
+    /* no pong yet, nothing to go by */
+    uint8_t max = nodes[node - POLL_FIRST_NODE].rtt_max;
+    if (max == 0)
+        return limit;
+
+    uint16_t timeout = max + max / 4 + TIMEOUT_MARGIN_MS;
+    return (timeout < limit ? timeout : limit);
+}
+
+static uint8_t *put16(uint8_t *p, uint16_t value) {
+    *p++ = value >> 8;
+    *p++ = value;
+    return p;
+}
+
+uint8_t health_report(uint8_t *buf, uint16_t now) {
+    while ((int16_t)(now - second_at) >= 1000) {
+        second_at += 1000;
+        seconds++;
+        if (--report_in == 0) {
+            report_in = HEALTH_REPORT_S;
+            report_node = POLL_FIRST_NODE;
+        }
+    }
+
+    if (report_node == 0)
+        return 0;
+
+    bool first = (report_node == POLL_FIRST_NODE);
+    uint8_t *p = buf + 8;
+    uint8_t records = 0;
+    for (; report_node <= POLL_LAST_NODE && records < RECORDS_PER_DATAGRAM; report_node++) {
+        uint8_t i = report_node - POLL_FIRST_NODE;
+        if (!nodes[i].known)
+            continue;
+
+        uint32_t age = seconds - nodes[i].last_seen;
+        uint16_t avg = (nodes[i].rtt_avg + 4) >> 3;
+
+        *p++ = report_node;
+        *p++ = (age > 255 ? 255 : age);
+        *p++ = (avg > 255 ? 255 : avg);
+        *p++ = nodes[i].rtt_max;
+        p = put16(p, nodes[i].crc_errors);
+        p = put16(p, nodes[i].timeouts);
+        p = put16(p, nodes[i].frames_up);
+        p = put16(p, nodes[i].frames_down);
+        records++;
+    }
+
+    if (report_node > POLL_LAST_NODE)
+        report_node = 0;
+    /* a report without any node still tells the uptime */
+    if (records == 0 && !first)
+        return 0;
+
+    buf[0] = HEALTH_VERSION;
+    buf[1] = records;
+    buf[2] = seconds >> 24;
+    buf[3] = seconds >> 16;
+    put16(buf + 4, seconds);
+    put16(buf + 6, crc_errors);
+
+    return p - buf;
+}
@@ -0,0 +1,41 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ */
+#ifndef _HEALTH_H
+#define _HEALTH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* multicast group (ff05::b5:fe) the table is published on */
+#define HEALTH_GROUP 0xfe
+
+/* publish the table every HEALTH_REPORT_S seconds */
+#ifndef HEALTH_REPORT_S
+#define HEALTH_REPORT_S 10
+#endif
+
+/* longest datagram health_report() returns */
+#define HEALTH_REPORT_MAX (8 + 10 * 12)
+
+/* a frame which the node has to answer (ping, send) went out, the answer
+ * is expected within 'wait' ms */
+void health_request(uint8_t node, uint16_t now, uint8_t wait);
+
+/* a frame from 'node' was received (and forwarded to Ethernet) */
+void health_frame(uint8_t node, bool pong, uint16_t now);
+
+/* a frame with a broken header checksum was received */
+void health_crc_error(uint16_t now);
+
+/* a command from Ethernet went out to 'node' */
+void health_command(uint8_t node);
+
+/* ms to wait for an answer of 'node', at most 'limit' */
+uint8_t health_timeout(uint8_t node, uint8_t limit);
+
+/* Fills 'buf' with the next datagram of the table when a report is due.
+ * Returns its length, 0 if there is nothing to send. */
+uint8_t health_report(uint8_t *buf, uint16_t now);
+
+#endif
@@ -10,42 +10,13 @@
 
 #include "compat.h"
 #include "enc28j60.h"
+#include "chksum.h"
 
 /* used to copy the old contents of uip_buf */
 static uint8_t saved[59];
 
 static const char mymac[6] PROGMEM = "\x02\xb5\x00\x00\x00\x00";
 
-static uint16_t chksum(uint16_t sum, const uint8_t *data, uint16_t len)
-{
-  uint16_t t;
-  const uint8_t *dataptr;
-  const uint8_t *last_byte;
-
-  dataptr = data;
-  last_byte = data + len - 1;
-
-  while(dataptr < last_byte) {  /* At least two more bytes */
-    t = (dataptr[0] << 8) + dataptr[1];
-    sum += t;
-    if(sum < t) {
-      sum++;            /* carry */
-    }
-    dataptr += 2;
-  }
-
-  if(dataptr == last_byte) {
-    t = (dataptr[0] << 8) + 0;
-    sum += t;
-    if(sum < t) {
-      sum++;            /* carry */
-    }
-  }
-
-  /* Return sum in host byte order. */
-  return sum;
-}
-
 static void start_icmpv6_reply(uint8_t *ip6) {
     memcpy(saved, uip_buf, 59);
     memcpy(uip_buf, uip_recvbuf + 6, 6);
@@ -55,23 +26,45 @@ static void start_icmpv6_reply(uint8_t *ip6) {
     memcpy(uip_buf + 22 + 16, ip6 + 8, 16); /* destination address */
 }
 
-static void finish_icmpv6_reply(uint8_t *ip6) {
+/* sends the reply with the checksum of 'icmp6' (the request), updated for
+ * the first word of the reply (type and code). Source and destination
+ * address trade places and the rest stays as it was, so the pseudo header
+ * and the data sum up to the same. */
+static void finish_icmpv6_reply_from(uint8_t *icmp6) {
+    uint16_t sum = chksum_update((icmp6[2] << 8) | icmp6[3],
+            (icmp6[0] << 8) | icmp6[1], (uip_buf[54] << 8) | uip_buf[55]);
+
+    uip_buf[56] = (sum & 0xFF00) >> 8;
+    uip_buf[57] = (sum & 0x00FF);
+
+    transmit_packet();
+    memcpy(uip_buf, saved, 59);
+}
+
+/* The fixed part of the checksum of a neighbor advertisement: payload length
+ * and next header of the pseudo header, type and code, the solicited flag
+ * and the target link-layer address option with mymac. */
+#define ADVERT_SUM (32 + 0x3a + 0x8800 + 0x4000 + 0x0201 + 0x02b5 + 0x0000 + 0x0000)
+
+/* sends the neighbor advertisement: the target is both the source address
+ * and in the message, so its sum is taken once and added twice, then only
+ * the destination address is left to sum up */
+static void finish_neighbor_adv(void) {
     uip_buf[56] = 0x00; /* checksum */
     uip_buf[57] = 0x00; /* checksum */
 
-    /* calculate UDP checksum */
-    uint16_t sum = 0;
-    sum = ip6[5] + 0x3a;
-    sum = chksum(sum, &uip_buf[22], 2 * 16);
-    sum = chksum(sum, &uip_buf[54], uip_buf[19]);
-    sum = (sum == 0 ? 0xffff : ~sum);
-    if (sum == 0)
-    sum = 0xffff;
+#ifdef ENC28J60_CHECKSUM_OFFLOAD
+    transmit_packet_checksum(56, uip_buf[19] + 0x3a);
+#else
+    uint16_t target = chksum(0, &uip_buf[22], 16);
+    uint16_t sum = chksum_add(chksum_add(ADVERT_SUM, target), target);
+    sum = ~chksum(sum, &uip_buf[22 + 16], 16);
 
     uip_buf[56] = (sum & 0xFF00) >> 8;
     uip_buf[57] = (sum & 0x00FF);
 
     transmit_packet();
+#endif
     memcpy(uip_buf, saved, 59);
 }
 
@@ -114,7 +107,7 @@ static bool handle_neighbor_sol() {
     uip_buf[19] = 32;
 
     uip_len = 86;
-    finish_icmpv6_reply(ip6);
+    finish_neighbor_adv();
 
     return true;
 }
@@ -159,7 +152,7 @@ static bool handle_echo_req() {
     uip_buf[19] = len;
 
     uip_len = 64 + (len-8);
-    finish_icmpv6_reply(ip6);
+    finish_icmpv6_reply_from(icmp6);
 
     return true;
 }
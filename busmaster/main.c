@@ -9,13 +9,20 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
-#include <util/delay.h>
+#include <avr/sleep.h>
 
 #include "spi.h"
 #include "enc28j60.h"
 #include "bus.h"
 #include "compat.h"
 #include "icmpv6.h"
+#include "poll.h"
+#include "health.h"
+#include "chksum.h"
+#include "telemetry.h"
+#ifdef BUS_MIRROR
+#include "mirror.h"
+#endif
 
 uint8_t lbuffer[32];
 /* If burst_remain > 0, we will immediately send out another sendreq to
@@ -30,9 +37,40 @@ uint8_t burst_sender = 0;
  *
  */
 
-/* time to wait for a message from the target in miliseconds */
+/* time to wait for a message from the target in miliseconds, less for
+ * nodes which answered faster so far (see health_timeout()) */
 #define MSG_WAIT_MS 15
 
+/* time between the answer of a node and the next frame on the bus */
+#define ANSWER_GAP_MS 2
+
+/* time between two frames the busmaster sends on the bus */
+#define SEND_SPACING_MS 25
+
+/* how often each node is pinged is decided in poll.c */
+
+/* how often the ENC28J60 is polled without interrupt (ENC28J60_POLL) */
+#define NET_POLL_MS 10
+
+/* bus frames waiting for a free transmit slot of the ENC28J60 */
+#ifndef UPSTREAM_QUEUE
+#define UPSTREAM_QUEUE 8
+#endif
+
+/* frames from the bus wait up to this long for more frames to the same
+ * group, see upstream_aggregate() */
+//#define UPSTREAM_AGGREGATE_MS 20
+
+/* commands from Ethernet waiting for the bus, the last DOWNLINK_RESERVE
+ * entries are kept free for urgent commands */
+#ifndef DOWNLINK_QUEUE
+#define DOWNLINK_QUEUE 8
+#endif
+#define DOWNLINK_RESERVE 2
+
+/* a command which can wait goes before the pings after this time */
+#define DOWNLINK_WAIT_MS 200
+
 /*
  * ----------------------------------------------------------------------
  *
@@ -88,76 +126,39 @@ uint16_t uip_recvlen = 0;
 
 bool gotmsg = true;
 
-static uint16_t chksum(uint16_t sum, const uint8_t *data, uint16_t len)
-{
-  uint16_t t;
-  const uint8_t *dataptr;
-  const uint8_t *last_byte;
-
-  dataptr = data;
-  last_byte = data + len - 1;
-
-  while(dataptr < last_byte) {  /* At least two more bytes */
-    t = (dataptr[0] << 8) + dataptr[1];
-    sum += t;
-    if(sum < t) {
-      sum++;            /* carry */
-    }
-    dataptr += 2;
-  }
-
-  if(dataptr == last_byte) {
-    t = (dataptr[0] << 8) + 0;
-    sum += t;
-    if(sum < t) {
-      sum++;            /* carry */
-    }
-  }
-
-  /* Return sum in host byte order. */
-  return sum;
-}
+#ifndef ENC28J60_CHECKSUM_OFFLOAD
+/* Sum of the IPv6 source and destination address in uip_buf, without their
+ * last bytes: only those (the bus addresses) change from frame to frame.
+ * The pseudo header of a frame is this plus the two bytes, the length and
+ * the next header, so the 32 address bytes are summed up only once. */
+static uint16_t address_sum;
 
-static void syslog_send(const char *str, int payload_len) {
-    uint16_t c;
-    int len = 8 /* udp header */ + payload_len;
-
-    uip_buf[5] = 1;
-    uip_buf[53] = 1;
+static void address_sum_init(void) {
+    uint8_t source = uip_buf[37];
+    uint8_t destination = uip_buf[53];
 
-    /* copy packet->source into the MAC and IPv6 address */
-    uip_buf[11] = 0;
     uip_buf[37] = 0;
+    uip_buf[53] = 0;
+    address_sum = chksum(0, &uip_buf[22], 2 * 16);
+    uip_buf[37] = source;
+    uip_buf[53] = destination;
+}
 
-
-    /* IPv6 header → length */
-    uip_buf[19] = len;
-
-    /* UDP header → length */
-    uip_buf[59] = len;
-
-    /* initialize UDP checksum to zero */
-    uip_buf[60] = 0x00;
-    uip_buf[61] = 0x00;
-
-    for (c = 0; c < payload_len; c++)
-        uip_buf[62 + c] = str[c];
-
-    /* calculate UDP checksum */
-    uint16_t sum = 0;
-    sum = len + 17;
-    sum = chksum(sum, (uint8_t*)&uip_buf[22], 2 * 16);
+/* fills in the checksum of the UDP datagram of 'len' bytes in uip_buf */
+static void udp_checksum(uint16_t len) {
+    /* the bus addresses are the low bytes of the last words */
+    uint16_t sum = chksum_add(address_sum, uip_buf[37]);
+    sum = chksum_add(sum, uip_buf[53]);
+    sum = chksum_add(sum, len + 17);
     sum = chksum(sum, &uip_buf[54], len);
-    sum = (sum == 0 ? 0xffff : ~sum);
+    sum = ~sum;
     if (sum == 0)
         sum = 0xffff;
 
     uip_buf[60] = (sum & 0xFF00) >> 8;
     uip_buf[61] = (sum & 0x00FF);
-
-    uip_len = 62 + payload_len;
-    transmit_packet();
 }
+#endif
 
 static void raw_send(const char *str, int payload_len) {
     uint16_t c;
@@ -173,32 +174,423 @@ static void raw_send(const char *str, int payload_len) {
     uip_buf[60] = 0x00;
     uip_buf[61] = 0x00;
 
-    for (c = 0; c < payload_len; c++)
-        uip_buf[62 + c] = str[c];
+    /* the payload may already be in place, see UIP_PAYLOAD */
+    if (str != (const char*)uip_buf + 62)
+        for (c = 0; c < payload_len; c++)
+            uip_buf[62 + c] = str[c];
 
-    /* calculate UDP checksum */
-    uint16_t sum = 0;
-    sum = len + 17;
-    sum = chksum(sum, (uint8_t*)&uip_buf[22], 2 * 16);
-    sum = chksum(sum, &uip_buf[54], len);
-    sum = (sum == 0 ? 0xffff : ~sum);
-    if (sum == 0)
-        sum = 0xffff;
+    uip_len = 62 + payload_len;
 
-    uip_buf[60] = (sum & 0xFF00) >> 8;
-    uip_buf[61] = (sum & 0x00FF);
+#ifndef ENC28J60_CHECKSUM_OFFLOAD
+    udp_checksum(len);
+#endif
 
-    uip_len = 62 + payload_len;
-    transmit_packet();
+    /* with ENC28J60_CHECKSUM_OFFLOAD, the controller calculates the checksum */
+    transmit_udp_packet();
+}
+
+
+
+/* The groups of the reports, ff05::b5:fc to ff05::b5:fe (MIRROR_GROUP,
+ * TELEMETRY_GROUP, HEALTH_GROUP). The pattern filter lets through those of
+ * the other busmasters on the segment as well. */
+static bool report_group(uint8_t group) {
+    return group >= 0xfc && group <= HEALTH_GROUP;
+}
+
+/* true if the IPv6 address 'ip' is ff05::b5:xx of a group whose frames go
+ * onto this bus (ENC28J60_FILTER_GROUPS) */
+static bool forwarded_group(const uint8_t *ip) {
+    if (ip[1] != 0x05 || ip[13] != 0xb5 || ip[14] != 0)
+        return false;
+    for (uint8_t i = 2; i < 13; i++)
+        if (ip[i] != 0)
+            return false;
+    return enc28j60_group(ip[15]);
+}
+
+/* The payload of a datagram of the busmaster itself is built right where
+ * raw_send() puts it, so there is no second buffer on the stack and nothing
+ * to copy. */
+#define UIP_PAYLOAD (uip_buf + 62)
+#if HEALTH_REPORT_MAX > UIP_BUFSIZE - 62 || TELEMETRY_REPORT_MAX > UIP_BUFSIZE - 62 || \
+    (defined(MIRROR_REPORT_MAX) && MIRROR_REPORT_MAX > UIP_BUFSIZE - 62)
+#error "a report does not fit uip_buf"
+#endif
+
+/* sends a datagram of the busmaster itself to ff05::b5:'group' */
+static void report_send(uint8_t group, const uint8_t *report, uint8_t len) {
+    uip_buf[5] = group; /* MAC */
+    uip_buf[53] = group; /* IPv6 */
+    uip_buf[11] = 0; /* MAC */
+    uip_buf[37] = 0; /* IPv6 */
+    raw_send((const char*)report, len);
+}
+
+/*
+ * Frames from the bus on their way to Ethernet. A node removes a frame from
+ * its own queue as soon as it sent it, so the busmaster keeps it here until
+ * the ENC28J60 has a free transmit slot instead of losing it to a full
+ * transmit queue. A frame is at most UARTBUF (lib/uart.c) bytes long.
+ */
+static struct {
+    uint8_t frame[UPSTREAM_QUEUE][32];
+#ifdef UPSTREAM_AGGREGATE_MS
+    uint16_t queued_at[UPSTREAM_QUEUE];
+#endif
+    uint8_t head;
+    uint8_t count;
+} upstream;
+
+/* see Timekeeping below */
+static uint16_t now(void);
+static bool due(uint16_t deadline);
+
+/* most frames queued at the same time, frames lost because the queue was
+ * full */
+uint8_t upstream_high_water;
+uint16_t upstream_dropped;
+
+static void upstream_push(struct buspkt *packet) {
+    if (upstream.count == UPSTREAM_QUEUE) {
+        upstream_dropped++;
+        return;
+    }
+
+    uint8_t slot = (upstream.head + upstream.count) % UPSTREAM_QUEUE;
+    memcpy(upstream.frame[slot], packet, sizeof(struct buspkt) + packet->length_lo);
+#ifdef UPSTREAM_AGGREGATE_MS
+    upstream.queued_at[slot] = now();
+#endif
+    upstream.count++;
+
+    if (upstream.count > upstream_high_water)
+        upstream_high_water = upstream.count;
+}
+
+#ifdef UPSTREAM_AGGREGATE_MS
+/*
+ * Frames from the bus to the same multicast group are collected and go out
+ * as one datagram to HAUSBUS_BATCH_PORT: a 5 byte event otherwise costs 62
+ * bytes of headers, a checksum over them and a transmit slot of its own.
+ * The payload is a sequence of records:
+ *
+ *   0     bus address of the sender
+ *   1     length of the payload
+ *   2-    payload of the bus frame
+ *
+ * The datagram is sent once the oldest frame waited UPSTREAM_AGGREGATE_MS,
+ * once its group has more frames than fit into one datagram, or when the
+ * queue is full. Receivers have to listen on HAUSBUS_BATCH_PORT, too;
+ * application/lib/Hausbus.pm splits the records up again.
+ */
+#define AGGREGATE_MAX (UIP_BUFSIZE - 14 - 40 - 8)
+
+static bool aggregate_due(void) {
+    if (upstream.count == UPSTREAM_QUEUE ||
+        due(upstream.queued_at[upstream.head] + UPSTREAM_AGGREGATE_MS))
+        return true;
+
+    uint8_t destination = ((struct buspkt*)upstream.frame[upstream.head])->destination;
+    uint16_t len = 0;
+    for (uint8_t i = 0; i < upstream.count; i++) {
+        struct buspkt *packet = (struct buspkt*)upstream.frame[(upstream.head + i) % UPSTREAM_QUEUE];
+        if (packet->destination != destination)
+            continue;
+        len += 2 + packet->length_lo;
+        if (len > AGGREGATE_MAX)
+            return true;
+    }
+    return false;
+}
+
+/* sends the frames for the group of the oldest frame, as many as fit */
+static void upstream_aggregate(void) {
+    uint8_t *datagram = UIP_PAYLOAD;
+    uint8_t len = 0;
+    uint8_t kept = 0;
+    bool full = false;
+    uint8_t destination = ((struct buspkt*)upstream.frame[upstream.head])->destination;
+
+    for (uint8_t i = 0; i < upstream.count; i++) {
+        uint8_t slot = (upstream.head + i) % UPSTREAM_QUEUE;
+        struct buspkt *packet = (struct buspkt*)upstream.frame[slot];
+
+        if (packet->destination == destination && !full) {
+            if (len + 2 + packet->length_lo <= AGGREGATE_MAX) {
+                datagram[len++] = packet->source;
+                datagram[len++] = packet->length_lo;
+                memcpy(datagram + len, (uint8_t*)packet + sizeof(struct buspkt), packet->length_lo);
+                len += packet->length_lo;
+                continue;
+            }
+            /* the rest of the group follows in the next datagram, in order */
+            full = true;
+        }
+
+        /* close the gap, the other frames keep their order */
+        uint8_t to = (upstream.head + kept) % UPSTREAM_QUEUE;
+        if (to != slot) {
+            memcpy(upstream.frame[to], upstream.frame[slot], sizeof(upstream.frame[0]));
+            upstream.queued_at[to] = upstream.queued_at[slot];
+        }
+        kept++;
+    }
+    upstream.count = kept;
+
+    uip_buf[5] = destination; /* MAC */
+    uip_buf[53] = destination; /* IPv6 */
+    uip_buf[11] = 0; /* MAC */
+    uip_buf[37] = 0; /* IPv6 */
+    uip_buf[57] = LO8(HAUSBUS_BATCH_PORT);
+    raw_send((const char*)datagram, len);
+    uip_buf[57] = LO8(HAUSBUS_PORT);
+}
+#endif
+
+/* sends the queued frames as long as the controller takes them */
+static void upstream_flush(void) {
+    while (upstream.count > 0 && enc28j60_transmit_ready()) {
+#ifdef UPSTREAM_AGGREGATE_MS
+        if (!aggregate_due())
+            return;
+        upstream_aggregate();
+#else
+        struct buspkt *packet = (struct buspkt*)upstream.frame[upstream.head];
+        uint8_t *payload = (uint8_t*)packet + sizeof(struct buspkt);
+
+        /* copy packet->destination into the MAC and IPv6 address */
+        uip_buf[5] = packet->destination; /* MAC */
+        uip_buf[53] = packet->destination; /* IPv6 */
+
+        /* copy packet->source into the MAC and IPv6 address */
+        uip_buf[11] = packet->source; /* MAC */
+        uip_buf[37] = packet->source; /* IPv6 */
+
+        raw_send((const char*)payload, packet->length_lo);
+
+        upstream.head = (upstream.head + 1) % UPSTREAM_QUEUE;
+        upstream.count--;
+#endif
+    }
+}
+
+/*
+ * Commands from Ethernet on their way to the bus, oldest first. A command
+ * sent with the IPv6 traffic class CS1 or LE (telemetry requests) waits
+ * until no ping is due, or at most DOWNLINK_WAIT_MS. Every other command
+ * goes out at the next frame boundary, before sendreqs and pings. Commands to the same node
+ * keep their order: an urgent command takes the ones queued before it for
+ * its node along.
+ *
+ * An urgent command which finds the queue full waits in uip_recvbuf. A
+ * command which can wait is dropped instead of blocking the urgent ones
+ * behind it in the controller.
+ */
+#define DOWNLINK_PAYLOAD (sizeof(lbuffer) - sizeof(struct buspkt))
+
+static struct {
+    struct {
+        uint8_t destination;
+        bool low;
+        uint16_t queued_at;
+        uint8_t len;
+        uint8_t payload[DOWNLINK_PAYLOAD];
+    } cmd[DOWNLINK_QUEUE];
+    uint8_t count;
+} downlink;
+
+/* DSCP CS1 (8) and LE (1) from the traffic class of the IPv6 header */
+static bool low_priority(const uint8_t *ip) {
+    uint8_t dscp = (((ip[0] & 0x0f) << 4) | (ip[1] >> 4)) >> 2;
+    return dscp == 8 || dscp == 1;
+}
+
+/* commands which could wait, dropped because the queue was full */
+uint16_t downlink_dropped;
+/* datagrams with a UDP length which does not fit the frame, commands too
+ * long for a bus frame and broken batch records */
+uint16_t downlink_invalid;
+
+/* false if the command has to wait in uip_recvbuf */
+static bool downlink_push(uint8_t destination, const uint8_t *payload, uint8_t len, bool low, uint16_t now) {
+    if (len > DOWNLINK_PAYLOAD) {
+        downlink_invalid++;
+        return true;
+    }
+    if (low && downlink.count >= DOWNLINK_QUEUE - DOWNLINK_RESERVE) {
+        downlink_dropped++;
+        return true;
+    }
+    if (downlink.count == DOWNLINK_QUEUE)
+        return false;
+
+    uint8_t i = downlink.count++;
+    downlink.cmd[i].destination = destination;
+    downlink.cmd[i].low = low;
+    downlink.cmd[i].queued_at = now;
+    downlink.cmd[i].len = len;
+    memcpy(downlink.cmd[i].payload, payload, len);
+    return true;
+}
+
+/* offset of the next record of the batch in uip_recvbuf */
+static uint8_t batch_at;
+
+/*
+ * A datagram to HAUSBUS_BATCH_PORT carries commands for several nodes, so a
+ * gateway updating many nodes needs one frame instead of one per node. The
+ * payload is a sequence of records:
+ *
+ *   0     bus address of the node
+ *   1     length of the command
+ *   2-    command
+ *
+ * The records are queued in order, all with the priority of the datagram.
+ * False if the queue is full: the datagram stays in uip_recvbuf and the next
+ * call goes on with the record which did not fit.
+ *
+ * A multicast datagram to HAUSBUS_BATCH_PORT carries the frames another
+ * busmaster aggregated (UPSTREAM_AGGREGATE_MS). The first byte of a record
+ * is the sender then, and every record goes to 'group', the group of the
+ * datagram, just like single frames to the group do. 'group' is -1 for a
+ * batch of commands.
+ */
+static bool downlink_batch(const uint8_t *data, uint8_t len, int16_t group, bool low, uint16_t now) {
+    while (batch_at < len) {
+        const uint8_t *record = data + batch_at;
+
+        /* a record running past the end makes the rest unusable */
+        if (len - batch_at < 2 || record[1] > len - batch_at - 2) {
+            downlink_invalid++;
+            break;
+        }
+        uint8_t destination = group < 0 ? record[0] : group;
+        if (!downlink_push(destination, record + 2, record[1], low, now))
+            return false;
+        batch_at += 2 + record[1];
+    }
+    batch_at = 0;
+    return true;
+}
+
+/* Index of the next urgent command, -1 if there is none: the oldest
+ * command for a node which has an urgent command queued. */
+static int8_t downlink_urgent(void) {
+    for (uint8_t i = 0; i < downlink.count; i++) {
+        if (downlink.cmd[i].low)
+            continue;
+        for (uint8_t j = 0; j <= i; j++)
+            if (downlink.cmd[j].destination == downlink.cmd[i].destination)
+                return j;
+    }
+    return -1;
+}
+
+/* puts command 'i' into lbuffer and removes it from the queue */
+static uint8_t downlink_take(uint8_t i) {
+    uint8_t destination = downlink.cmd[i].destination;
+
+    fmt_packet(lbuffer, destination, 0xFF, downlink.cmd[i].payload, downlink.cmd[i].len);
+    downlink.count--;
+    memmove(&downlink.cmd[i], &downlink.cmd[i + 1], (downlink.count - i) * sizeof(downlink.cmd[0]));
+    return destination;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * Timekeeping: timer 1 counts milliseconds, the main loop sleeps until the
+ * next interrupt (at the latest the next millisecond) and compares
+ * deadlines with now().
+ *
+ */
+
+/* also read by the bus mirror (lib/mirror.h) */
+volatile uint16_t timer_ms;
+
+ISR(TIMER1_COMPA_vect) {
+    timer_ms++;
+}
+
+static uint16_t now(void) {
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t t = timer_ms;
+    SREG = sreg;
+    return t;
+}
+
+/* true once 'deadline' has passed, also when ms wrapped around */
+static bool due(uint16_t deadline) {
+    return (int16_t)(now() - deadline) >= 0;
+}
+
+static void timer_init(void) {
+    /* CTC mode, F_CPU / 8 / (OCR1A + 1) = 1 kHz */
+    TCCR1A = 0;
+    TCCR1B = (1 << WGM12) | (1 << CS11);
+    OCR1A = F_CPU / 8 / 1000 - 1;
+    TIMSK1 = (1 << OCIE1A);
+}
+
+/* no frame is put on the bus before this time */
+static uint16_t bus_free_at;
+/* a node announced waiting messages, send it a sendreq */
+static bool sendreq;
+/* poll the controller with ENC28J60_POLL, see network_process() */
+static uint16_t net_poll_at;
+/* skipping the bytes of a frame with a broken header */
+static bool skipping;
+
+/* the bus is free and lbuffer may be overwritten */
+static bool bus_ready(void) {
+    return !bus_sending() && due(bus_free_at);
 }
 
+/* sends the frame in lbuffer, the next one follows 'spacing' ms later */
+static void bus_send(uint8_t spacing) {
+    send_packet((struct buspkt*)lbuffer);
+    bus_free_at = now() + spacing;
+}
+
+/* sends command 'i' of the downlink queue */
+static void command_send(uint8_t i) {
+    uint8_t destination = downlink_take(i);
 
+    bus_send(SEND_SPACING_MS);
+    TELEMETRY(TELEMETRY_INFO, TELEMETRY_COMMAND_SENT, destination,
+            ((struct buspkt*)lbuffer)->length_lo, now());
+    poll_command(destination, now());
+    health_command(destination);
+}
+
+/* a command to the busmaster itself (its unicast address, port
+ * HAUSBUS_PORT): "level" and one byte sets telemetry_level, "mirror" and
+ * 0 or 1 switches the bus mirror off or on */
+static void busmaster_command(const uint8_t *payload, uint8_t len) {
+    if (len == 6 && memcmp(payload, "level", 5) == 0 && payload[5] <= TELEMETRY_DEBUG) {
+        telemetry_level = payload[5];
+        TELEMETRY(TELEMETRY_ERROR, TELEMETRY_LEVEL_CHANGED, telemetry_level, 0, now());
+    }
+#ifdef BUS_MIRROR
+    if (len == 7 && memcmp(payload, "mirror", 6) == 0 && payload[6] <= 1)
+        mirror_enabled = payload[6];
+#endif
+}
+
+/* something for the main loop to do, checked with interrupts disabled. A
+ * frame in the controller has to wait while uip_recvbuf is still taken. */
+static bool work_waiting(void) {
+    return (enc28j60_pending() && uip_recvlen == 0) || bus_status() != BUS_STATUS_IDLE;
+}
 
 int main(int argc, char *argv[]) {
     /* Disable driver enable for RS485 ASAP */
     DDRC |= (1 << PC2);
     PORTC &= ~(1 << PC2);
 
+    timer_init();
+
     /* Initialize UART */
     net_init();
 
@@ -212,48 +604,116 @@ int main(int argc, char *argv[]) {
 
     DBG("Initialized ENC28J60\r\n");
 
-    int cnt = 0;
+    TELEMETRY(TELEMETRY_INFO, TELEMETRY_BOOT, enc28j60_revision, 0, now());
+
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    poll_init(now());
+#ifndef ENC28J60_CHECKSUM_OFFLOAD
+    address_sum_init();
+#endif
+
     while (1) {
-        network_process();
+        /* uip_recvbuf is only refilled once the last frame was handled */
+        if (uip_recvlen == 0 && (enc28j60_pending() || due(net_poll_at))) {
+            net_poll_at = now() + NET_POLL_MS;
+            network_process();
+        }
+        upstream_flush();
+
         if (uip_recvlen > 0) {
             DBG("Handling packet\r\n");
-            handle_icmpv6();
 
             /* Is this a UDP packet? */
             if (uip_recvbuf[20] == 0x11) {
                 /* UDP */
                 uint8_t *udp = uip_recvbuf + 14 + 40;
-                uint8_t len = udp[5] - 8;
-                /* TODO: sanity check */
+                uint16_t len = (udp[4] << 8) | udp[5];
                 uint8_t *recvpayload = udp + 8 /* udp */;
+                bool low = low_priority(uip_recvbuf + 14);
+                bool queued = true;
+
+                /* with the queue full, the frame stays in uip_recvbuf and
+                 * the next ones in the controller */
+                if (len < 8 || len > uip_recvlen - 14 - 40) {
+                    downlink_invalid++;
+                } else if (uip_recvbuf[14 + 24] == 0xff &&
+                        (report_group(uip_recvbuf[53]) || !forwarded_group(uip_recvbuf + 14 + 24))) {
+                    /* reports of the other busmasters and multicasts which
+                     * only share a bucket of the hash filter, not for the bus */
+                } else if (udp[2] == HI8(HAUSBUS_BATCH_PORT) && udp[3] == LO8(HAUSBUS_BATCH_PORT)) {
+                    /* batches of commands come to our unicast address, the
+                     * multicast ones are frames aggregated by a busmaster */
+                    int16_t group = uip_recvbuf[14 + 24] == 0xff ? uip_recvbuf[53] : -1;
+                    queued = downlink_batch(recvpayload, len - 8, group, low, now());
+                } else if (uip_recvbuf[53] == MYADDRESS && uip_recvbuf[14 + 24] != 0xff) {
+                    busmaster_command(recvpayload, len - 8);
+                } else {
+                    queued = downlink_push(uip_recvbuf[53], recvpayload, len - 8, low, now());
+                }
 
-                fmt_packet(lbuffer, uip_recvbuf[53], 0xFF, recvpayload, len);
-                struct buspkt *packet = (struct buspkt*)lbuffer;
-
-                //syslog_send("sending packet", strlen("sending packet"));
-                send_packet(packet);
-                _delay_ms(25);
-                syslog_send("ethernet to rs485 done", strlen("ethernet to rs485 done"));
-                cnt = 35;
+                if (queued)
+                    uip_recvlen = 0;
+            } else {
+                handle_icmpv6();
+                uip_recvlen = 0;
             }
+        }
+
+        /* at every frame boundary: urgent commands, sendreqs, commands
+         * which waited long enough, pings, and then the other commands */
+        int8_t urgent;
+        if (bus_ready() && (urgent = downlink_urgent()) >= 0)
+            command_send(urgent);
+
+        if (sendreq && bus_ready()) {
+            /* request the message */
+            fmt_packet(lbuffer, burst_sender, 0, "send", 4);
+            bus_send(SEND_SPACING_MS);
+            health_request(burst_sender, now(), SEND_SPACING_MS);
+            TELEMETRY(TELEMETRY_DEBUG, TELEMETRY_SENDREQ_SENT, burst_sender, burst_remain, now());
+            sendreq = false;
+        }
+
+        if (downlink.count > 0 && due(downlink.cmd[0].queued_at + DOWNLINK_WAIT_MS) && bus_ready())
+            command_send(0);
+
+        uint8_t node;
+        if (bus_ready() && (node = poll_next(now())) != 0) {
+            fmt_packet(lbuffer, node, 0, "ping", 4);
+            TELEMETRY(TELEMETRY_DEBUG, TELEMETRY_PING_SENT, node, 0, now());
+            /* give the node time to answer */
+            uint8_t wait = health_timeout(node, MSG_WAIT_MS);
+            bus_send(wait);
+            poll_sent(node, now());
+            health_request(node, now(), wait);
+        }
 
-            //syslog_send("received a packet", strlen("received a packet"));
+        if (downlink.count > 0 && bus_ready())
+            command_send(0);
 
-            //syslog_send(uip_recvbuf, uip_recvlen);
-            uip_recvlen = 0;
+        /* node statistics and telemetry, behind the frames from the bus */
+        if (upstream.count == 0 && enc28j60_transmit_ready()) {
+            uint8_t len = health_report(UIP_PAYLOAD, now());
+            if (len > 0)
+                report_send(HEALTH_GROUP, UIP_PAYLOAD, len);
         }
-        _delay_ms(10);
-        if (cnt++ == 50) {
-            fmt_packet(lbuffer, 1, 0, "ping", 4);
-            struct buspkt *packet = (struct buspkt*)lbuffer;
-            syslog_send("ping sent", strlen("ping sent"));
-            send_packet(packet);
-            cnt = 0;
+        if (upstream.count == 0 && enc28j60_transmit_ready()) {
+            uint8_t len = telemetry_report(UIP_PAYLOAD, now());
+            if (len > 0)
+                report_send(TELEMETRY_GROUP, UIP_PAYLOAD, len);
         }
+#ifdef BUS_MIRROR
+        if (upstream.count == 0 && enc28j60_transmit_ready()) {
+            uint8_t len = mirror_report(UIP_PAYLOAD, now());
+            if (len > 0)
+                report_send(MIRROR_GROUP, UIP_PAYLOAD, len);
+        } else {
+            /* keep the ring empty while Ethernet is busy */
+            mirror_collect();
+        }
+#endif
 
         uint8_t status = bus_status();
-        if (status == BUS_STATUS_IDLE)
-            continue;
 
         if (status == BUS_STATUS_MESSAGE) {
             /* get a copy of the current packet */
@@ -264,66 +724,67 @@ int main(int argc, char *argv[]) {
             /* check for ping replies */
             if (packet->destination == 0x00 &&
                 memcmp(payload, "pong", strlen("pong")) == 0) {
-                syslog_send("pong received", strlen("pong received"));
-                /* TODO: store that this controller is reachable */
+                TELEMETRY(TELEMETRY_DEBUG, TELEMETRY_PONG_RECEIVED, packet->source, payload[4], now());
+                bool answer = poll_pong(packet->source, payload[4], now());
+                health_frame(packet->source, true, now());
                 /* check if the controller has any waiting messages */
 
                 if (payload[4] > 0) {
                     burst_remain = (payload[4] - 1);
                     burst_sender = packet->source;
-
-                    /* request the message */
-                    fmt_packet(lbuffer, packet->source, 0, "send", 4);
-                    struct buspkt *reply = (struct buspkt*)lbuffer;
-                    //syslog_send("sending packet", strlen("sending packet"));
-                    _delay_ms(25);
-                    send_packet(reply);
-                    syslog_send("sendreq sent", strlen("sendreq sent"));
-                    //syslog_send(reply, reply->length_lo + sizeof(struct buspkt));
-
-                    _delay_ms(25);
-                    cnt = 0;
+                    sendreq = true;
+                    bus_free_at = now() + SEND_SPACING_MS;
+                } else if (answer && !due(bus_free_at - ANSWER_GAP_MS)) {
+                    /* no need to wait out MSG_WAIT_MS, the node has
+                     * answered */
+                    bus_free_at = now() + ANSWER_GAP_MS;
                 }
             } else {
+                health_frame(packet->source, false, now());
                 if (packet->source == burst_sender && burst_remain > 0) {
                     burst_remain--;
-                    fmt_packet(lbuffer, packet->source, 0, "send", 4);
-                    struct buspkt *reply = (struct buspkt*)lbuffer;
-                    //syslog_send("sending packet", strlen("sending packet"));
-                    _delay_ms(25);
-                    send_packet(reply);
-                    syslog_send("nother sendreq sent", strlen("nother sendreq sent"));
-                    //syslog_send(reply, reply->length_lo + sizeof(struct buspkt));
-
-                    _delay_ms(25);
-                    cnt = 0;
+                    sendreq = true;
+                    bus_free_at = now() + SEND_SPACING_MS;
                 } else {
                     burst_sender = 0;
                     burst_remain = 0;
                 }
             }
 
-            /* copy packet->destination into the MAC and IPv6 address */
-            uip_buf[5] = packet->destination; /* MAC */
-            uip_buf[53] = packet->destination; /* IPv6 */
-
-            /* copy packet->source into the MAC and IPv6 address */
-            uip_buf[11] = packet->source; /* MAC */
-            uip_buf[37] = packet->source; /* IPv6 */
-
-            raw_send(payload, packet->length_lo);
+            /* forward it to Ethernet */
+            upstream_push(packet);
+            upstream_flush();
 
             /* discard the packet from serial buffer */
             packet_done();
-            continue;
-        }
-
-        if (status == BUS_STATUS_WRONG_CRC) {
-            syslog_send("broken", strlen("broken"));
+            skipping = false;
+        } else if (status == BUS_STATUS_WRONG_CRC) {
             struct buspkt *packet = current_packet();
-            raw_send(packet, 16);
+
+            /* count the frame, not every byte skipped */
+            if (!skipping) {
+                health_crc_error(now());
+                TELEMETRY(TELEMETRY_ERROR, TELEMETRY_BROKEN_HEADER,
+                        packet->destination, packet->source, now());
+            }
+            skipping = true;
+#ifndef BUS_MIRROR
+            /* the raw bytes on ff05::b5:1, for every byte skipped (the
+             * mirror has them all, with their timestamps) */
+            if (telemetry_level >= TELEMETRY_DEBUG)
+                report_send(1, (const uint8_t*)packet, 16);
+#endif
             skip_byte();
-            continue;
         }
+
+        /* sleep until the next interrupt, unless one already brought work */
+        cli();
+        if (!work_waiting()) {
+            sleep_enable();
+            sei();
+            sleep_cpu();
+            sleep_disable();
+        }
+        sei();
     }
 }
@@ -0,0 +1,202 @@
+#!/usr/bin/env perl
+# vim:ts=4:sw=4:expandtab
+#
+# Writes the test captures for mock_busmaster -r (see README) to stdout. The
+# frames are addressed as on the real network: the busmaster has the MAC
+# 02:b5:00:00:00:00, the nodes are fd1a:56e6:97e9:0:b5:ff:fe00:<address>,
+# the peer sending everything is fd1a:56e6:97e9::42. The random parts are
+# seeded, the same scenario always gives the same file.
+#
+#   quiet   20 frames in 10 s, the usual LAN noise (mDNS, ARP, neighbor
+#           solicitations, a ping to the busmaster, a command for node 1)
+#   busy    the same mix, 400 frames 3 ms apart, with large multicast frames
+#   down    every 2 s a sweep of "stat" commands to nodes 1-29 (CS1, one
+#           datagram each), in between "open" commands for nodes 1-3
+#   batch   as down, the sweeps as batch datagrams (port 41998), plus a
+#           datagram with a wrong UDP length, one with a truncated record
+#           and a command longer than a bus frame
+#   icmp    neighbor solicitations for bus addresses, with and without
+#           source link-layer address option, and echo requests of
+#           different lengths
+#   flood   3000 echo requests to the busmaster, 2 ms apart
+#   segment what another busmaster on the segment sends: every second its
+#           health, telemetry and mirror reports, a frame of its bus to
+#           group 50 and three more aggregated into one datagram (port
+#           41998, UPSTREAM_AGGREGATE_MS), and a frame to group 71, which
+#           shares the hash filter bucket of 50 but is not forwarded
+#
+# Usage: perl mkpcap.pl quiet|busy|down|batch|icmp|flood|segment > capture.pcap
+
+use strict;
+use warnings;
+
+my $scenario = shift // '';
+
+my $busmaster_mac = pack('H*', '02b500000000');
+my $peer_mac = pack('H*', '001122334455');
+my $busmaster = pack('H*', 'fd1a56e697e9000000b500fffe000000');
+my $peer = pack('H*', 'fd1a56e697e900000000000000000042');
+
+sub node {
+    my ($address) = @_;
+    return substr($busmaster, 0, 15) . chr($address);
+}
+
+# the solicited-node multicast address and its MAC
+sub solicited {
+    my ($ip) = @_;
+    return (pack('H*', 'ff0200000000000000000001ff') . substr($ip, 13),
+        pack('H*', '3333ff') . substr($ip, 13));
+}
+
+sub checksum {
+    my ($data) = @_;
+    $data .= "\0" if length($data) % 2;
+    my $sum = 0;
+    $sum += $_ for unpack('n*', $data);
+    $sum = ($sum & 0xffff) + ($sum >> 16) while $sum >> 16;
+    return ~$sum & 0xffff;
+}
+
+# IPv6 packet with a UDP or ICMPv6 payload, checksum filled in
+sub ipv6 {
+    my ($src, $dst, $next, $payload, $class) = @_;
+    $class //= 0;
+    my $offset = $next == 17 ? 6 : 2;
+    my $sum = checksum($src . $dst . pack('NxxxC', length($payload), $next) . $payload);
+    substr($payload, $offset, 2) = pack('n', $sum || ($next == 17 ? 0xffff : 0));
+    return pack('NnCC', 0x60000000 | $class << 20, length($payload), $next, 255)
+        . $src . $dst . $payload;
+}
+
+sub ethernet {
+    my ($dst, $type, $payload) = @_;
+    return $dst . $peer_mac . pack('n', $type) . $payload;
+}
+
+sub udp {
+    my ($dst_mac, $dst, $src_port, $dst_port, $data, $class, $length) = @_;
+    $length //= 8 + length($data);
+    return ethernet($dst_mac, 0x86dd, ipv6($peer, $dst, 17,
+        pack('nnnn', $src_port, $dst_port, $length, 0) . $data, $class));
+}
+
+sub neighbor_solicitation {
+    my ($target, $option) = @_;
+    my ($group, $mac) = solicited($target);
+    my $ns = pack('CCnN', 135, 0, 0, 0) . $target;
+    $ns .= pack('CC', 1, 1) . $peer_mac if $option;
+    return ethernet($mac, 0x86dd, ipv6($peer, $group, 58, $ns));
+}
+
+sub echo_request {
+    my ($sequence, $data) = @_;
+    return ethernet($busmaster_mac, 0x86dd, ipv6($peer, $busmaster, 58,
+        pack('CCnnn', 128, 0, 0, 0x1234, $sequence) . $data));
+}
+
+# a datagram of another busmaster to ff05::b5:<group>, from one of its nodes
+sub multicast {
+    my ($group, $source, $port, $data) = @_;
+    my $ip = pack('H*', 'ff050000000000000000000000b500') . chr($group);
+    return ethernet(pack('H*', '333300b500') . chr($group), 0x86dd, ipv6(node($source), $ip, 17,
+        pack('nnnn', $port, $port, 8 + length($data), 0) . $data));
+}
+
+# a command for a node, as Hausbus.pm sends it
+sub command {
+    my ($address, $data, $class) = @_;
+    return udp($busmaster_mac, node($address), 1234, 41999, $data, $class);
+}
+
+# one random frame of the LAN noise
+sub noise {
+    my ($i, $large) = @_;
+    my $r = rand();
+    my $other = substr($peer, 0, 13) . pack('C3', 1, 2, 3);
+
+    return neighbor_solicitation(node(1)) if $r < 0.05;
+    return echo_request($i & 0xff, 'ping' x 4) if $r < 0.08;
+    return command(1, 'open') if $r < 0.10;
+    if ($r < 0.5) {
+        my $mdns = pack('C*', map { int(rand(256)) } 1 .. 40 + int(rand(100)));
+        return udp(pack('H*', '3333000000fb'), pack('H*', 'ff0200000000000000000000000000fb'),
+            5353, 5353, $mdns);
+    }
+    return neighbor_solicitation($other) if $r < 0.7;
+    return ethernet("\xff" x 6, 0x0806, "\0" x 28) if $r < 0.9 || !$large;
+    # SSDP
+    return udp(pack('H*', '33330000000c'), pack('H*', 'ff02000000000000000000000000000c'),
+        1900, 1900, "\0" x 300);
+}
+
+# the CS1 sweeps and the urgent commands of down and batch
+sub commands {
+    my ($frames, $sweep) = @_;
+
+    for my $n (0 .. 9) {
+        $sweep->($frames, 1 + 2 * $n, $n);
+    }
+    my $i = 0;
+    for (my $t = 1.05; $t < 21; $t += 0.7 + rand(0.6)) {
+        push @$frames, [ $t, command(1 + $i % 3, 'open' . chr($i & 0xff)) ];
+        $i++;
+    }
+}
+
+my @frames;
+
+if ($scenario eq 'quiet') {
+    srand(1);
+    push @frames, [ 0.5 * $_, noise($_, 0) ] for 0 .. 19;
+} elsif ($scenario eq 'busy') {
+    srand(1);
+    push @frames, [ 0.003 * ($_ + 1), noise($_, 1) ] for 0 .. 399;
+} elsif ($scenario eq 'down') {
+    srand(2);
+    commands(\@frames, sub {
+        my ($frames, $t, $n) = @_;
+        push @$frames, [ $t + 0.001 * $_, command($_, 'stat' . chr($n), 0x20) ] for 1 .. 29;
+    });
+} elsif ($scenario eq 'batch') {
+    srand(2);
+    commands(\@frames, sub {
+        my ($frames, $t, $n) = @_;
+        my @records = map { pack('CC/a*', $_, 'stat' . chr($n)) } 1 .. 29;
+        for (my $k = 0; $k < @records; $k += 19) {
+            my $last = $k + 18 < $#records ? $k + 18 : $#records;
+            push @$frames, [ $t + 0.001 * $k, udp($busmaster_mac, node(0), 1234, 41998,
+                join('', @records[$k .. $last]), 0x20) ];
+        }
+    });
+    push @frames, [ 1.5, udp($busmaster_mac, node(5), 1234, 41999, 'xx', 0, 80) ],
+        [ 1.6, udp($busmaster_mac, node(0), 1234, 41998, pack('CC/a*', 4, 'ok') . pack('CC', 5, 9) . 'abc') ],
+        [ 1.7, command(6, 'y' x 40) ];
+} elsif ($scenario eq 'icmp') {
+    for my $i (0 .. 19) {
+        push @frames, [ 1 + 0.1 * $i, neighbor_solicitation(node($i % 5), $i % 2) ],
+            [ 1.05 + 0.1 * $i, echo_request($i, pack('C*', 0 .. 3 * $i - 1)) ];
+    }
+} elsif ($scenario eq 'flood') {
+    push @frames, [ 1 + 0.002 * $_, echo_request($_, "\0" x 40) ] for 0 .. 2999;
+} elsif ($scenario eq 'segment') {
+    for my $i (0 .. 19) {
+        my $t = 1 + $i;
+        push @frames, [ $t, multicast(0xfe, 0, 41999, "\0" x 128) ],
+            [ $t + 0.01, multicast(0xfd, 0, 41999, "\0" x 20) ],
+            [ $t + 0.02, multicast(0xfc, 0, 41999, "\0" x 138) ],
+            [ $t + 0.5, multicast(50, 5, 41999, 'temp' . chr($i)) ],
+            [ $t + 0.6, multicast(71, 5, 41999, 'temp' . chr($i)) ],
+            [ $t + 0.7, multicast(50, 0, 41998, join('', map { pack('CC/a*', $_, 'temp' . chr($i)) } 6 .. 8)) ];
+    }
+} else {
+    die "Usage: $0 quiet|busy|down|batch|icmp|flood|segment > capture.pcap\n";
+}
+
+binmode(STDOUT);
+print pack('LSSlLLL', 0xa1b2c3d4, 2, 4, 0, 0, 65535, 1);
+for my $frame (sort { $a->[0] <=> $b->[0] } @frames) {
+    my ($t, $data) = @$frame;
+    my $usec = int(($t - int($t)) * 1e6 + 0.5);
+    print pack('LLLL', int($t) + int($usec / 1e6), $usec % 1000000, length($data), length($data)), $data;
+}
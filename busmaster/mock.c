@@ -0,0 +1,1372 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * Host build of the busmaster network path.
+ *
+ * The ENC28J60 is modelled behind spi_send(): register banks, buffer memory,
+ * receive ring, transmit logic and the receive filters. Ethernet frames are
+ * read from a pcap file into the receive ring (and from there by
+ * process_packet() into uip_recvbuf), every frame started by
+ * transmit_packet() is written to an output pcap. Time is virtual: delays
+ * and SPI transfers advance mock_cycles, timestamps are derived from it.
+ *
+ * At the end, a report shows how much SPI time the busmaster spent on frames
+ * it handled and on frames it read but then ignored.
+ *
+ * With -b, nodes send that many frames over the bus, one every 10 ms,
+ * starting one second into the simulation. With -s, the Ethernet is busy
+ * for a while (e.g. -s 1000:300 from 1 s to 1.3 s): transmissions started
+ * then only finish at its end.
+ *
+ * With -n, nodes 1 to n answer pings. Each of them has an event (a frame for
+ * the busmaster) every -e ms on average, for the first -t seconds; the report
+ * shows how long events waited on their node until the busmaster fetched
+ * them. With -l, nodes miss that percentage of pings. With -a, that
+ * percentage of transmissions ends with TXERIF (aborted).
+ *
+ * See the "mock" target in the Makefile.
+ */
+#undef main
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <math.h>
+
+#include <avr/io.h>
+#include <util/delay.h>
+
+#include "enc28j60.h"
+#include "compat.h"
+#include "bus.h"
+#ifdef BUS_MIRROR
+#include "mirror.h"
+#endif
+
+/* rough cost of one spi_send() (SPI at f/2 plus call and polling overhead)
+ * and of toggling chip select, in CPU cycles */
+#define SPI_BYTE_CYCLES 22
+#define SPI_CS_CYCLES   4
+
+/* 10 Mbit/s: one byte on the wire takes 0.8 µs */
+#define WIRE_CYCLES(bytes) ((uint64_t)(bytes) * 8 * (F_CPU / 10000000UL))
+
+/* stop this long (virtual) after the last input frame was handled */
+#define DRAIN_CYCLES (F_CPU / 2)
+
+#define MEMSIZE 8192
+
+extern uint64_t mock_cycles;
+extern void (*mock_delay_hook)(void);
+extern void (*mock_sleep_hook)(void);
+
+int busmaster_main(int argc, char *argv[]);
+void TIMER1_COMPA_vect(void);
+extern uint8_t upstream_high_water;
+extern uint16_t upstream_dropped;
+extern uint16_t downlink_dropped;
+extern uint16_t downlink_invalid;
+#ifndef ENC28J60_POLL
+void INT2_vect(void);
+#endif
+
+/*
+ * ----------------------------------------------------------------------
+ * pcap files
+ *
+ */
+
+#define PCAP_MAGIC      0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define DLT_EN10MB      1
+
+struct pcap_file_header {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_record_header {
+    uint32_t ts_sec;
+    uint32_t ts_frac;
+    uint32_t caplen;
+    uint32_t len;
+};
+
+static FILE *pcap_in;
+static FILE *pcap_out;
+static bool pcap_swapped;
+static bool pcap_nsec;
+
+static uint32_t swap32(uint32_t v) {
+    return ((v & 0xff) << 24) | ((v & 0xff00) << 8) |
+           ((v >> 8) & 0xff00) | (v >> 24);
+}
+
+static void pcap_open_in(const char *path) {
+    struct pcap_file_header hdr;
+
+    if ((pcap_in = fopen(path, "rb")) == NULL) {
+        perror(path);
+        exit(1);
+    }
+    if (fread(&hdr, sizeof(hdr), 1, pcap_in) != 1) {
+        fprintf(stderr, "%s: short pcap header\n", path);
+        exit(1);
+    }
+
+    if (hdr.magic == PCAP_MAGIC || hdr.magic == PCAP_MAGIC_NSEC) {
+        pcap_swapped = false;
+    } else if (swap32(hdr.magic) == PCAP_MAGIC || swap32(hdr.magic) == PCAP_MAGIC_NSEC) {
+        pcap_swapped = true;
+        hdr.magic = swap32(hdr.magic);
+        hdr.linktype = swap32(hdr.linktype);
+    } else {
+        fprintf(stderr, "%s: not a pcap file\n", path);
+        exit(1);
+    }
+    pcap_nsec = (hdr.magic == PCAP_MAGIC_NSEC);
+
+    if (hdr.linktype != DLT_EN10MB) {
+        fprintf(stderr, "%s: link type %u is not Ethernet\n", path, hdr.linktype);
+        exit(1);
+    }
+}
+
+/*
+ * Reads the next frame from the input pcap. Returns its length (truncated to
+ * 'size') or -1 at the end of the file. The timestamp is returned in µs.
+ *
+ */
+static int pcap_read(uint8_t *buf, uint16_t size, uint64_t *ts_us) {
+    struct pcap_record_header rec;
+
+    if (pcap_in == NULL || fread(&rec, sizeof(rec), 1, pcap_in) != 1)
+        return -1;
+
+    if (pcap_swapped) {
+        rec.ts_sec = swap32(rec.ts_sec);
+        rec.ts_frac = swap32(rec.ts_frac);
+        rec.caplen = swap32(rec.caplen);
+    }
+
+    *ts_us = (uint64_t)rec.ts_sec * 1000000 + (pcap_nsec ? rec.ts_frac / 1000 : rec.ts_frac);
+
+    uint32_t keep = (rec.caplen < size ? rec.caplen : size);
+    if (fread(buf, 1, keep, pcap_in) != keep)
+        return -1;
+    if (rec.caplen > keep)
+        fseek(pcap_in, rec.caplen - keep, SEEK_CUR);
+
+    return keep;
+}
+
+static void pcap_open_out(const char *path) {
+    struct pcap_file_header hdr = {
+        .magic = PCAP_MAGIC,
+        .version_major = 2,
+        .version_minor = 4,
+        .snaplen = 65535,
+        .linktype = DLT_EN10MB
+    };
+
+    if ((pcap_out = fopen(path, "wb")) == NULL) {
+        perror(path);
+        exit(1);
+    }
+    fwrite(&hdr, sizeof(hdr), 1, pcap_out);
+}
+
+static void pcap_write(const uint8_t *frame, uint16_t len) {
+    if (pcap_out == NULL)
+        return;
+
+    uint64_t us = mock_cycles / (F_CPU / 1000000UL);
+    struct pcap_record_header rec = {
+        .ts_sec = us / 1000000,
+        .ts_frac = us % 1000000,
+        .caplen = len,
+        .len = len
+    };
+    fwrite(&rec, sizeof(rec), 1, pcap_out);
+    fwrite(frame, 1, len, pcap_out);
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * statistics
+ *
+ */
+
+static struct {
+    uint32_t frames_in;
+    uint32_t rx_disabled;
+    uint32_t filtered;
+    uint32_t overflow;
+    uint32_t lost_in_reset;
+    uint32_t read;
+    uint32_t handled;
+    uint32_t ignored;
+    uint32_t tx_frames;
+    uint32_t loopback;
+    uint32_t tx_aborted;
+    uint32_t tx_unreset;
+    uint32_t tx_clobbered;
+    uint32_t bus_frames;
+    uint32_t bus_in;
+    uint32_t upstream;
+    uint32_t upstream_datagrams;
+    uint32_t mirror_bytes;
+    uint32_t mirror_datagrams;
+    uint64_t upstream_wait_sum;
+    uint64_t upstream_wait_max;
+    uint32_t resets;
+    uint64_t passes;
+    uint64_t interrupts;
+    uint64_t spi_transactions;
+    uint64_t bank_switch_ops;
+    uint64_t spi_bytes;
+    uint64_t spi_cycles;
+    uint64_t cycles_handled;
+    uint64_t cycles_ignored;
+    uint32_t commands;
+    uint64_t latency_sum;
+    uint64_t latency_max;
+    uint32_t commands_low;
+    uint64_t latency_low_sum;
+    uint64_t latency_low_max;
+    uint32_t pings;
+    uint32_t pings_absent;
+    uint32_t pongs;
+    uint32_t events;
+    uint32_t events_lost;
+    uint32_t events_fetched;
+    uint64_t event_wait_sum;
+    uint64_t event_wait_max;
+} stats;
+
+/* Attribution of SPI time to received frames: a window opens when the driver
+ * points ERDPT at the start of a queued frame (process_packet() starts
+ * reading it) and closes at the next delay, i.e. when the main loop pass
+ * which handled the frame is over. */
+static bool started;
+static uint64_t start_cycles;
+static bool window_open;
+static bool window_reacted;
+static uint64_t window_cycles;
+
+static void window_close(void) {
+    if (!window_open)
+        return;
+
+    if (window_reacted) {
+        stats.handled++;
+        stats.cycles_handled += window_cycles;
+    } else {
+        stats.ignored++;
+        stats.cycles_ignored += window_cycles;
+    }
+    window_open = false;
+}
+
+static void window_start(void) {
+    window_close();
+    window_open = true;
+    window_reacted = false;
+    window_cycles = 0;
+    stats.read++;
+}
+
+static void charge(uint32_t cycles) {
+    mock_cycles += cycles;
+    stats.spi_cycles += cycles;
+    if (window_open)
+        window_cycles += cycles;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * ENC28J60 model
+ *
+ */
+
+/* frames waiting in the receive ring, oldest first */
+#define RXQUEUE 256
+
+static struct {
+    uint8_t regs[4][32];
+    uint16_t phy[32];
+    uint8_t mem[MEMSIZE];
+
+    uint16_t rx_write;
+    /* ERXRDPT as the MAC uses it: ERXRDPTL only counts once ERXRDPTH is
+     * written */
+    uint16_t rx_read;
+    struct {
+        uint16_t start;
+        uint16_t size;
+        uint64_t at;
+    } rxq[RXQUEUE];
+    uint16_t rxq_head;
+    uint8_t pktcnt;
+
+    uint64_t tx_done_at;
+    /* the frame in flight ends with TXERIF, see -a */
+    bool tx_abort;
+    /* a transmission was aborted, TXRST is due (errata #12) */
+    bool tx_stalled;
+} enc;
+
+static struct {
+    enum { SPI_IDLE, SPI_OPCODE, SPI_RCR, SPI_WCR, SPI_BFS, SPI_BFC, SPI_RBM, SPI_WBM, SPI_DONE } state;
+    uint8_t addr;
+} spi;
+
+/* address of a banked or common register, as defined in enc28j60.h */
+static uint8_t *reg(uint8_t address) {
+    uint8_t a = address & REGISTER_ADDRESS_MASK;
+    if (a >= KEY_REGISTERS)
+        return &enc.regs[0][a];
+    return &enc.regs[(address & REGISTER_BANK_MASK) >> 5][a];
+}
+
+/* registers as returned by bank_address(), without the dummy byte flag */
+#define NODUMMY(address) ((address) & 0x7F)
+
+/* the register 'a' addresses in the currently selected bank */
+static uint8_t bank_address(uint8_t a) {
+    if (a >= KEY_REGISTERS)
+        return a;
+    return a | ((enc.regs[0][REG_ECON1 & REGISTER_ADDRESS_MASK] & BANK_MASK) << 5);
+}
+
+static uint16_t reg16(uint8_t low) {
+    return *reg(low) | (*reg(low + 1) << 8);
+}
+
+static void set_reg16(uint8_t low, uint16_t value) {
+    *reg(low) = LO8(value);
+    *reg(low + 1) = HI8(value);
+}
+
+/* EREVID of the modelled controller, B7 unless set with -R */
+static uint8_t revision = 0x06;
+
+static void enc_reset(void) {
+    memset(enc.regs, 0, sizeof(enc.regs));
+    memset(enc.phy, 0, sizeof(enc.phy));
+    *reg(REG_ESTAT) = _BV(CLKRDY);
+    *reg(REG_ECON2) = _BV(AUTOINC);
+    *reg(REG_EREVID) = revision;
+    *reg(REG_ERXFCON) = _BV(UCEN) | _BV(CRCEN) | _BV(BCEN);
+    set_reg16(REG_ERXNDL, 0x1FFF);
+    set_reg16(REG_ERXRDPTL, 0x0FFA);
+    *reg(REG_MACON1) = 0;
+    *reg(REG_MACON2) = _BV(MARST);
+
+    stats.lost_in_reset += enc.pktcnt;
+    enc.rx_write = 0;
+    enc.rx_read = 0x0FFA;
+    enc.rxq_head = 0;
+    enc.pktcnt = 0;
+    enc.tx_done_at = 0;
+    enc.tx_abort = false;
+    enc.tx_stalled = false;
+
+    if (started)
+        stats.resets++;
+}
+
+static uint16_t rx_wrap(uint32_t address) {
+    uint16_t start = reg16(REG_ERXSTL), end = reg16(REG_ERXNDL);
+    if (address > end)
+        address = start + (address - end - 1);
+    return address;
+}
+
+/* a transmit has finished once the frame went out on the wire */
+static void enc_update(void) {
+    if ((*reg(REG_ECON1) & _BV(ECON1_TXRTS)) && mock_cycles >= enc.tx_done_at) {
+        *reg(REG_ECON1) &= ~_BV(ECON1_TXRTS);
+        *reg(REG_EIR) |= _BV(TXIF);
+        if (enc.tx_abort) {
+            *reg(REG_EIR) |= _BV(TXERIF);
+            *reg(REG_ESTAT) |= _BV(TXABRT);
+            enc.tx_stalled = true;
+            stats.tx_aborted++;
+        }
+    }
+}
+
+/* INT is low while INTIE is set and an enabled flag is pending. INT2 is
+ * level triggered: the handler runs while INT is low, unless the firmware
+ * masked INT2. */
+static void enc_interrupt(void) {
+    uint8_t eie = *reg(REG_EIE);
+    bool low = (eie & _BV(INTIE)) && (*reg(REG_EIR) & eie & ~_BV(INTIE));
+
+    if (low)
+        PINB &= ~_BV(INT_PIN_PIN);
+    else PINB |= _BV(INT_PIN_PIN);
+
+#ifndef ENC28J60_POLL
+    if (low && (EIMSK & _BV(INT2))) {
+        stats.interrupts++;
+        INT2_vect();
+    }
+#endif
+}
+
+/* CRC-32 as used by Ethernet (and by the hash table filter) */
+static uint32_t ether_crc(const uint8_t *data, uint16_t len) {
+    uint32_t crc = 0xffffffff;
+    for (uint16_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (uint8_t b = 0; b < 8; b++)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static bool filter_accepts(const uint8_t *frame, uint16_t len) {
+    uint8_t fcon = *reg(REG_ERXFCON);
+    const uint8_t mac[6] = {
+        *reg(REG_MAADR5), *reg(REG_MAADR4), *reg(REG_MAADR3),
+        *reg(REG_MAADR2), *reg(REG_MAADR1), *reg(REG_MAADR0)
+    };
+    bool broadcast = (memcmp(frame, "\xff\xff\xff\xff\xff\xff", 6) == 0);
+    bool multicast = !broadcast && (frame[0] & 1);
+    bool unicast = !broadcast && !multicast;
+
+    /* all filters disabled: promiscuous mode */
+    if ((fcon & ~(_BV(CRCEN) | _BV(ANDOR))) == 0)
+        return true;
+
+    bool results[5];
+    bool enabled[5] = {
+        fcon & _BV(UCEN), fcon & _BV(MCEN), fcon & _BV(BCEN), fcon & _BV(HTEN),
+        fcon & _BV(PMEN)
+    };
+    results[0] = unicast && memcmp(frame, mac, 6) == 0;
+    results[1] = multicast;
+    results[2] = broadcast;
+    uint8_t pointer = (ether_crc(frame, 6) >> 23) & 0x3f;
+    results[3] = (*reg(REG_EHT0 + (pointer >> 3)) >> (pointer & 7)) & 1;
+
+    /* pattern match: IP checksum over the bytes EPMM selects from the 64
+     * bytes at EPMO; short frames are padded on the wire */
+    uint32_t sum = 0;
+    uint16_t offset = reg16(REG_EPMOL);
+    for (uint8_t i = 0, n = 0; i < 64; i++) {
+        if (!((*reg(REG_EPMM0 + (i >> 3)) >> (i & 7)) & 1))
+            continue;
+        uint8_t b = (offset + i < len) ? frame[offset + i] : 0;
+        sum += (n++ & 1) ? b : b << 8;
+    }
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    results[4] = (uint16_t)~sum == reg16(REG_EPMCSL);
+
+    bool and_mode = fcon & _BV(ANDOR);
+    bool accept = and_mode;
+    for (int i = 0; i < 5; i++) {
+        if (!enabled[i])
+            continue;
+        if (and_mode)
+            accept = accept && results[i];
+        else accept = accept || results[i];
+    }
+    return accept;
+}
+
+static void rx_put(uint8_t byte) {
+    enc.mem[enc.rx_write] = byte;
+    enc.rx_write = rx_wrap(enc.rx_write + 1);
+}
+
+/*
+ * Puts a frame into the receive ring, as the MAC would do after receiving it
+ * from the wire.
+ *
+ */
+static void enc_receive(const uint8_t *frame, uint16_t len, bool loopback) {
+    if (!(*reg(REG_ECON1) & _BV(ECON1_RXEN))) {
+        if (!loopback)
+            stats.rx_disabled++;
+        return;
+    }
+    if (!filter_accepts(frame, len)) {
+        if (!loopback)
+            stats.filtered++;
+        return;
+    }
+
+    /* free space as in the data sheet, up to the read pointer */
+    uint16_t ringsize = reg16(REG_ERXNDL) - reg16(REG_ERXSTL);
+    uint16_t free;
+    if (enc.rx_write > enc.rx_read)
+        free = ringsize - (enc.rx_write - enc.rx_read);
+    else if (enc.rx_write == enc.rx_read)
+        free = ringsize;
+    else free = enc.rx_read - enc.rx_write - 1;
+
+    uint16_t size = (6 + len + 4 + 1) & ~1;
+    if (enc.pktcnt == 255 || size > free) {
+        *reg(REG_EIR) |= _BV(RXERIF);
+        stats.overflow++;
+        return;
+    }
+    if (loopback)
+        stats.loopback++;
+
+    uint16_t start = enc.rx_write;
+    uint16_t next = rx_wrap(start + size);
+    uint32_t crc = ether_crc(frame, len);
+
+    /* next packet pointer and receive status vector */
+    rx_put(LO8(next));
+    rx_put(HI8(next));
+    rx_put(LO8(len + 4));
+    rx_put(HI8(len + 4));
+    rx_put(_BV(7)); /* received ok */
+    rx_put((frame[0] & 1) ? (memcmp(frame, "\xff\xff", 2) == 0 ? 0x03 : 0x01) : 0x00);
+    for (uint16_t i = 0; i < len; i++)
+        rx_put(frame[i]);
+    for (uint8_t i = 0; i < 4; i++)
+        rx_put((crc >> (8 * i)) & 0xff);
+    enc.rx_write = next;
+    set_reg16(REG_ERXWRPTL, next);
+
+    uint16_t slot = (enc.rxq_head + enc.pktcnt) % RXQUEUE;
+    enc.rxq[slot].start = start;
+    enc.rxq[slot].size = size;
+    enc.rxq[slot].at = mock_cycles;
+    enc.pktcnt++;
+    *reg(REG_EPKTCNT) = enc.pktcnt;
+    *reg(REG_EIR) |= _BV(PKTIF);
+}
+
+static void enc_packet_decrement(void) {
+    if (enc.pktcnt == 0)
+        return;
+
+    enc.rxq_head = (enc.rxq_head + 1) % RXQUEUE;
+    enc.pktcnt--;
+    *reg(REG_EPKTCNT) = enc.pktcnt;
+    if (enc.pktcnt == 0)
+        *reg(REG_EIR) &= ~_BV(PKTIF);
+}
+
+/* the firmware writes to the transmit buffer at 'address', which must not
+ * be part of the frame in flight */
+static void tx_write(uint16_t address) {
+    if ((*reg(REG_ECON1) & _BV(ECON1_TXRTS)) &&
+            address >= reg16(REG_ETXSTL) && address <= reg16(REG_ETXNDL))
+        stats.tx_clobbered++;
+}
+
+/* The DMA engine copies EDMAST..EDMAND to EDMADST, or with ECON1.CSUMEN
+ * computes the IP checksum over it. Both finish instantly here. */
+static void enc_dma(void) {
+    uint16_t start = reg16(REG_EDMASTL), end = reg16(REG_EDMANDL);
+
+    if (*reg(REG_ECON1) & _BV(ECON1_CSUMEN)) {
+        uint32_t sum = 0;
+        for (uint16_t p = start, i = 0; ; p = (p + 1) % MEMSIZE, i++) {
+            sum += (i & 1) ? enc.mem[p] : enc.mem[p] << 8;
+            if (p == end)
+                break;
+        }
+        while (sum >> 16)
+            sum = (sum & 0xFFFF) + (sum >> 16);
+        *reg(REG_EDMACSH) = HI8(~sum);
+        *reg(REG_EDMACSL) = LO8(~sum);
+    } else {
+        for (uint16_t p = start, d = reg16(REG_EDMADSTL); ; p = (p + 1) % MEMSIZE, d = (d + 1) % MEMSIZE) {
+            tx_write(d);
+            enc.mem[d] = enc.mem[p];
+            if (p == end)
+                break;
+        }
+    }
+
+    *reg(REG_ECON1) &= ~_BV(ECON1_DMAST);
+    *reg(REG_EIR) |= _BV(DMAIF);
+}
+
+/* UDP frames the busmaster read and did not send to the bus yet, to
+ * measure the latency of commands */
+#define COMMANDS 256
+
+static struct {
+    uint8_t destination;
+    bool low;
+    uint8_t len;
+    uint8_t payload[26];
+    uint64_t at;
+} command[COMMANDS];
+static uint16_t commands_read;
+static uint64_t command_last_at;
+
+static void command_add(uint8_t destination, bool low, const uint8_t *payload, uint8_t len, uint64_t at) {
+    if (commands_read == COMMANDS)
+        return;
+    command[commands_read].destination = destination;
+    command[commands_read].low = low;
+    command[commands_read].len = (len > 26 ? 26 : len);
+    memcpy(command[commands_read].payload, payload, command[commands_read].len);
+    command[commands_read].at = at;
+    commands_read++;
+}
+
+static void command_read(uint16_t start, uint64_t at) {
+    uint8_t frame[UIP_BUFSIZE];
+
+    /* a frame may be read in several steps */
+    if (at == command_last_at)
+        return;
+    command_last_at = at;
+
+    /* skip next packet pointer and receive status vector */
+    for (uint16_t i = 0, p = rx_wrap(start + 6); i < sizeof(frame); i++, p = rx_wrap(p + 1))
+        frame[i] = enc.mem[p];
+    if (frame[12] != 0x86 || frame[13] != 0xdd || frame[20] != 0x11)
+        return;
+
+    uint16_t port = (frame[56] << 8) | frame[57];
+    if (port != HAUSBUS_PORT && port != HAUSBUS_BATCH_PORT)
+        return;
+
+    /* the command is queued, it counts as handled */
+    window_reacted = true;
+
+    uint8_t dscp = (((frame[14] & 0x0f) << 4) | (frame[15] >> 4)) >> 2;
+    bool low = (dscp == 8 || dscp == 1);
+    uint16_t len = ((frame[58] << 8) | frame[59]) - 8;
+    if (len > sizeof(frame) - 62)
+        return;
+    if (port == HAUSBUS_PORT) {
+        command_add(frame[53], low, frame + 62, len, at);
+        return;
+    }
+
+    /* batch: (node, length, command) records, or (sender, length, frame)
+     * records for the group of a multicast one */
+    for (uint16_t i = 0; i + 2 <= len && i + 2 + frame[62 + i + 1] <= len; i += 2 + frame[62 + i + 1])
+        command_add(frame[38] == 0xff ? frame[53] : frame[62 + i], low, frame + 62 + i + 2, frame[62 + i + 1], at);
+}
+
+/* the command read first which matches the bus frame */
+static int command_find(struct buspkt *pkt) {
+    uint8_t *payload = (uint8_t*)pkt + sizeof(struct buspkt);
+
+    for (int i = 0; i < commands_read; i++)
+        if (command[i].destination == pkt->destination && command[i].len == pkt->length_lo &&
+            memcmp(command[i].payload, payload, command[i].len) == 0)
+            return i;
+    return -1;
+}
+
+/* when the event with this (wrapping) number left its node */
+static uint64_t event_fetched_at[256];
+
+static void upstream_sent(uint8_t event) {
+    uint64_t wait = mock_cycles - event_fetched_at[event];
+    stats.upstream++;
+    stats.upstream_wait_sum += wait;
+    if (wait > stats.upstream_wait_max)
+        stats.upstream_wait_max = wait;
+}
+
+/* Ethernet busy window, see -s */
+static uint64_t stall_from, stall_until;
+/* share of aborted transmissions, see -a */
+static double tx_abort_rate;
+
+static void enc_transmit(void) {
+    uint16_t start = reg16(REG_ETXSTL), end = reg16(REG_ETXNDL);
+    uint8_t frame[MEMSIZE];
+    uint16_t len = 0;
+
+    enc.tx_abort = tx_abort_rate > 0 && rand() < tx_abort_rate * RAND_MAX;
+
+    /* the per packet control byte at ETXST is not sent */
+    for (uint16_t a = start + 1; a <= end && a < MEMSIZE; a++)
+        frame[len++] = enc.mem[a];
+
+    pcap_write(frame, len);
+    stats.tx_frames++;
+    if (window_open)
+        window_reacted = true;
+
+    /* transmit status vector follows the frame */
+    for (uint8_t i = 0; i < 7; i++)
+        enc.mem[(end + 1 + i) % MEMSIZE] = 0;
+    enc.mem[(end + 1) % MEMSIZE] = LO8(len);
+    enc.mem[(end + 2) % MEMSIZE] = HI8(len);
+
+    if (len >= 66 && memcmp(frame + 62, "door", 4) == 0) {
+        upstream_sent(frame[66]);
+        stats.upstream_datagrams++;
+    }
+
+    /* aggregated bus frames: (source, length, payload) records */
+    if (len >= 62 && frame[20] == 0x11 && ((frame[56] << 8) | frame[57]) == HAUSBUS_BATCH_PORT) {
+        bool events = false;
+        for (uint16_t i = 62; i + 2 <= len && i + 2 + frame[i + 1] <= len; i += 2 + frame[i + 1]) {
+            if (frame[i + 1] == 5 && memcmp(frame + i + 2, "door", 4) == 0) {
+                upstream_sent(frame[i + 6]);
+                events = true;
+            }
+        }
+        if (events)
+            stats.upstream_datagrams++;
+    }
+
+#ifdef BUS_MIRROR
+    if (len >= 62 && frame[38] == 0xff && frame[53] == MIRROR_GROUP)
+        stats.mirror_datagrams++;
+#endif
+
+    /* the frame goes out when the medium is free again */
+    uint64_t begin = mock_cycles;
+    if (begin >= stall_from && begin < stall_until)
+        begin = stall_until;
+    enc.tx_done_at = begin + WIRE_CYCLES(8 + (len < 60 ? 60 : len) + 4 + 12);
+
+    /* in half-duplex mode, the PHY loops our own frames back to the MAC */
+    if (!(enc.phy[PHY_PHCON1] & _BV(PDPXMD)) && !(enc.phy[PHY_PHCON2] & _BV(HDLDIS)))
+        enc_receive(frame, len, true);
+}
+
+static uint8_t read_reg(uint8_t a) {
+    return *reg(bank_address(a));
+}
+
+static void write_reg(uint8_t a, uint8_t value) {
+    uint8_t address = bank_address(a);
+    uint8_t *r = reg(address);
+    uint8_t old = *r;
+
+    switch (address) {
+    case REG_EREVID:
+    case REG_EPKTCNT:
+        /* read-only */
+        return;
+    case REG_ESTAT:
+        /* the driver clears flags, the oscillator keeps running */
+        *r = value | _BV(CLKRDY);
+        return;
+    }
+
+    *r = value;
+
+    switch (address) {
+    case REG_ETXSTL:
+    case REG_ETXSTH:
+    case REG_ETXNDL:
+    case REG_ETXNDH:
+        if (*reg(REG_ECON1) & _BV(ECON1_TXRTS))
+            stats.tx_clobbered++;
+        break;
+    case REG_ECON1:
+        if (value & _BV(ECON1_TXRST))
+            enc.tx_stalled = false;
+        if ((value & _BV(ECON1_TXRTS)) && !(old & _BV(ECON1_TXRTS))) {
+            if (enc.tx_stalled)
+                stats.tx_unreset++;
+            enc_transmit();
+        }
+        if ((value & _BV(ECON1_DMAST)) && !(old & _BV(ECON1_DMAST)))
+            enc_dma();
+        break;
+    case REG_ECON2:
+        if (value & _BV(PKTDEC))
+            enc_packet_decrement();
+        *r &= ~_BV(PKTDEC);
+        break;
+    case REG_EIR:
+        /* PKTIF is only cleared by decrementing EPKTCNT to zero */
+        if (enc.pktcnt > 0)
+            *r |= _BV(PKTIF);
+        break;
+    case REG_ERXRDPTH:
+        enc.rx_read = reg16(REG_ERXRDPTL);
+        break;
+    case REG_ERDPTH:
+        for (uint16_t i = 0; i < enc.pktcnt; i++)
+            if (enc.rxq[(enc.rxq_head + i) % RXQUEUE].start == reg16(REG_ERDPTL)) {
+                window_start();
+                command_read(reg16(REG_ERDPTL), enc.rxq[(enc.rxq_head + i) % RXQUEUE].at);
+            }
+        break;
+    case NODUMMY(REG_MICMD):
+        if (value & _BV(MIIRD))
+            set_reg16(REG_MIRDL, enc.phy[*reg(REG_MIREGADR) & 0x1F]);
+        break;
+    case NODUMMY(REG_MIWRH):
+        enc.phy[*reg(REG_MIREGADR) & 0x1F] = reg16(REG_MIWRL);
+        break;
+    }
+}
+
+void mock_enc28j60_select(void) {
+    spi.state = SPI_OPCODE;
+    stats.spi_transactions++;
+    charge(SPI_CS_CYCLES);
+}
+
+void mock_enc28j60_release(void) {
+    spi.state = SPI_IDLE;
+}
+
+void spi_init(void) {
+}
+
+uint8_t spi_send(uint8_t data) {
+    uint8_t out = 0;
+
+    stats.spi_bytes++;
+    charge(SPI_BYTE_CYCLES);
+    enc_update();
+
+    switch (spi.state) {
+    case SPI_IDLE:
+        fprintf(stderr, "mock: spi_send(0x%02x) without chip select\n", data);
+        break;
+
+    case SPI_OPCODE:
+        spi.addr = data & REGISTER_ADDRESS_MASK;
+        if (data == CMD_RESET) {
+            enc_reset();
+            spi.state = SPI_DONE;
+        } else if (data == CMD_RBM) {
+            spi.state = SPI_RBM;
+        } else if (data == CMD_WBM) {
+            spi.state = SPI_WBM;
+        } else if ((data & 0xE0) == CMD_RCR) {
+            spi.state = SPI_RCR;
+        } else if ((data & 0xE0) == CMD_WCR) {
+            spi.state = SPI_WCR;
+        } else if ((data & 0xE0) == CMD_BFS) {
+            spi.state = SPI_BFS;
+        } else if ((data & 0xE0) == CMD_BFC) {
+            spi.state = SPI_BFC;
+        } else {
+            fprintf(stderr, "mock: unknown spi opcode 0x%02x\n", data);
+            spi.state = SPI_DONE;
+        }
+        break;
+
+    case SPI_RCR:
+        /* MAC and MII registers send a dummy byte first, the driver reads
+         * twice; returning the value both times is fine */
+        out = read_reg(spi.addr);
+        break;
+
+    case SPI_WCR:
+        write_reg(spi.addr, data);
+        spi.state = SPI_DONE;
+        break;
+
+    case SPI_BFS:
+        if (spi.addr == REG_ECON1 && (data & BANK_MASK))
+            stats.bank_switch_ops++;
+        write_reg(spi.addr, read_reg(spi.addr) | data);
+        spi.state = SPI_DONE;
+        break;
+
+    case SPI_BFC:
+        if (spi.addr == REG_ECON1 && (data & BANK_MASK))
+            stats.bank_switch_ops++;
+        write_reg(spi.addr, read_reg(spi.addr) & ~data);
+        spi.state = SPI_DONE;
+        break;
+
+    case SPI_RBM: {
+        uint16_t p = reg16(REG_ERDPTL);
+        out = enc.mem[p % MEMSIZE];
+        if (*reg(REG_ECON2) & _BV(AUTOINC)) {
+            /* the read pointer wraps inside the receive buffer */
+            if (p == reg16(REG_ERXNDL))
+                p = reg16(REG_ERXSTL);
+            else p = (p + 1) % MEMSIZE;
+            set_reg16(REG_ERDPTL, p);
+        }
+        break;
+    }
+
+    case SPI_WBM: {
+        uint16_t p = reg16(REG_EWRPTL);
+        tx_write(p % MEMSIZE);
+        enc.mem[p % MEMSIZE] = data;
+        if (*reg(REG_ECON2) & _BV(AUTOINC))
+            set_reg16(REG_EWRPTL, (p + 1) % MEMSIZE);
+        break;
+    }
+
+    case SPI_DONE:
+        break;
+    }
+
+    return out;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * RS485 side: the bus is not simulated here, frames sent to it are counted,
+ * frames from nodes (-b) are made up
+ *
+ */
+
+static uint8_t bus_packet[32];
+static bool verbose;
+static uint32_t bus_pending;
+static uint64_t bus_next_at = F_CPU;
+
+void net_init() {
+}
+
+uint8_t bus_sending() {
+    return 0;
+}
+
+/* nodes 1 to -n answer pings and deliver their events on "send" */
+#define MAX_NODES 29
+#define NODE_EVENTS 8
+
+/* from the end of a frame of the busmaster to the end of the answer: two
+ * frames of about 11 characters at 38400 baud plus turnaround */
+#define REPLY_CYCLES (F_CPU / 1000 * 6)
+
+static uint8_t nodes_present;
+static double ping_loss;
+static uint64_t event_cycles;
+static uint64_t events_until;
+
+static struct {
+    /* every node draws its events from its own sequence, so that they do
+     * not depend on the timing of the busmaster */
+    unsigned int seed;
+    uint64_t next_event;
+    /* times of the waiting events, oldest first */
+    uint64_t event_at[NODE_EVENTS];
+    uint8_t waiting;
+} node[MAX_NODES + 1];
+
+/* the answer of a node, handed out by bus_status() once it is due */
+static uint8_t reply[32];
+static uint64_t reply_at;
+static bool reply_ready;
+static bool reading_reply;
+
+#ifdef BUS_MIRROR
+/* one character at 38400 baud, 9 data bits */
+#define CHAR_CYCLES (F_CPU * 11 / 38400)
+#define WIRE_BYTES 64
+
+/* the bytes of the answers, handed to the mirror by tick() when the RX
+ * interrupt would see them; bit 8 is the address bit */
+static struct {
+    uint64_t at;
+    uint16_t c;
+} wire[WIRE_BYTES];
+static uint8_t wire_head, wire_count;
+
+/* puts a frame on the wire, its last byte arrives at 'end' */
+static void wire_frame(const uint8_t *frame, uint8_t len, uint64_t end) {
+    for (uint8_t i = 0; i < len && wire_count < WIRE_BYTES; i++) {
+        uint8_t w = (wire_head + wire_count++) % WIRE_BYTES;
+        wire[w].at = end - (uint64_t)(len - 1 - i) * CHAR_CYCLES;
+        wire[w].c = frame[i] | (i == 0 ? 0x100 : 0);
+    }
+}
+#endif
+
+/* exponentially distributed time until the next event of node 'n' */
+static uint64_t event_gap(uint8_t n) {
+    return (uint64_t)(-log(1.0 - rand_r(&node[n].seed) / (RAND_MAX + 1.0)) * event_cycles) + 1;
+}
+
+static void node_events(void) {
+    for (uint8_t n = 1; n <= nodes_present && event_cycles > 0; n++) {
+        while (node[n].next_event <= mock_cycles && node[n].next_event < events_until) {
+            if (node[n].waiting < NODE_EVENTS)
+                node[n].event_at[node[n].waiting++] = node[n].next_event;
+            else stats.events_lost++;
+            stats.events++;
+            node[n].next_event += event_gap(n);
+        }
+    }
+}
+
+/* the nodes answer pings forever, the simulation ends once all events
+ * are fetched */
+static bool events_waiting(void) {
+    for (uint8_t n = 1; n <= nodes_present; n++)
+        if (node[n].waiting > 0)
+            return true;
+    return false;
+}
+
+/* a node sees a frame of the busmaster */
+static void node_receive(struct buspkt *pkt) {
+    uint8_t n = pkt->destination;
+    uint8_t *payload = (uint8_t*)pkt + sizeof(struct buspkt);
+
+    if (n < 1 || n > MAX_NODES || pkt->length_lo != 4)
+        return;
+
+    if (memcmp(payload, "ping", 4) == 0) {
+        stats.pings++;
+        if (n > nodes_present) {
+            stats.pings_absent++;
+            return;
+        }
+        if (rand() < ping_loss * RAND_MAX)
+            return;
+        uint8_t pong[5] = { 'p', 'o', 'n', 'g', node[n].waiting };
+        fmt_packet(reply, 0, n, pong, sizeof(pong));
+    } else if (memcmp(payload, "send", 4) == 0 && n <= nodes_present && node[n].waiting > 0) {
+        uint64_t wait = mock_cycles - node[n].event_at[0];
+        stats.events_fetched++;
+        stats.event_wait_sum += wait;
+        if (wait > stats.event_wait_max)
+            stats.event_wait_max = wait;
+        node[n].waiting--;
+        memmove(node[n].event_at, node[n].event_at + 1, node[n].waiting * sizeof(uint64_t));
+
+        uint8_t event[5] = { 'd', 'o', 'o', 'r', stats.events_fetched };
+        event_fetched_at[event[4]] = mock_cycles;
+        fmt_packet(reply, 0, n, event, sizeof(event));
+    } else {
+        return;
+    }
+
+    reply_ready = true;
+    reply_at = mock_cycles + REPLY_CYCLES;
+#ifdef BUS_MIRROR
+    wire_frame(reply, sizeof(struct buspkt) + ((struct buspkt *)reply)->length_lo, reply_at);
+#endif
+}
+
+uint8_t bus_status() {
+    reading_reply = false;
+    if (reply_ready && mock_cycles >= reply_at) {
+        memcpy(bus_packet, reply, sizeof(bus_packet));
+        reading_reply = true;
+        return BUS_STATUS_MESSAGE;
+    }
+
+    if (bus_pending == 0 || !started || mock_cycles - start_cycles < bus_next_at)
+        return BUS_STATUS_IDLE;
+
+    uint8_t payload[5] = { 'd', 'o', 'o', 'r', stats.bus_in };
+    fmt_packet(bus_packet, 0, 2, payload, sizeof(payload));
+    return BUS_STATUS_MESSAGE;
+}
+
+struct buspkt *current_packet() {
+    return (struct buspkt *)bus_packet;
+}
+
+void packet_done() {
+    if (reading_reply) {
+        stats.bus_in++;
+        if (memcmp(reply + sizeof(struct buspkt), "pong", 4) == 0)
+            stats.pongs++;
+        reply_ready = false;
+        reading_reply = false;
+    } else if (bus_pending > 0) {
+        bus_pending--;
+        stats.bus_in++;
+        bus_next_at += F_CPU / 100;
+    }
+}
+
+void skip_byte() {
+}
+
+void send_packet(struct buspkt *pkt) {
+    stats.bus_frames++;
+
+    /* commands from Ethernet have source 0xFF, see main.c */
+    int i;
+    if (pkt->source == 0xFF && (i = command_find(pkt)) >= 0) {
+        uint64_t latency = mock_cycles - command[i].at;
+        if (command[i].low) {
+            stats.commands_low++;
+            stats.latency_low_sum += latency;
+            if (latency > stats.latency_low_max)
+                stats.latency_low_max = latency;
+        } else {
+            stats.commands++;
+            stats.latency_sum += latency;
+            if (latency > stats.latency_max)
+                stats.latency_max = latency;
+        }
+        commands_read--;
+        memmove(&command[i], &command[i + 1], (commands_read - i) * sizeof(command[0]));
+    }
+
+    if (window_open)
+        window_reacted = true;
+    if (verbose)
+        fprintf(stderr, "mock: bus frame to %d, %d bytes\n", pkt->destination, pkt->length_lo);
+
+    node_receive(pkt);
+}
+
+void uart_puts(char *str) {
+    if (verbose)
+        fprintf(stderr, "[UART] %s", str);
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * simulation
+ *
+ */
+
+static uint8_t next_frame[NET_MAX_FRAME_LENGTH + 18];
+static int next_len = -1;
+static uint64_t next_at;
+static uint64_t first_ts;
+static uint64_t idle_since;
+
+static void read_next(void) {
+    uint64_t ts;
+
+    next_len = pcap_read(next_frame, sizeof(next_frame), &ts);
+    if (next_len < 0)
+        return;
+
+    if (stats.frames_in++ == 0)
+        first_ts = ts;
+    next_at = start_cycles + (ts - first_ts) * (F_CPU / 1000000UL);
+}
+
+static void report(void) {
+    double mhz = F_CPU / 1e6;
+
+    window_close();
+    fprintf(stderr, "virtual time               %10.3f s\n", mock_cycles / mhz / 1e6);
+    fprintf(stderr, "frames in input            %10u\n", stats.frames_in);
+    fprintf(stderr, "  dropped, rx disabled     %10u\n", stats.rx_disabled);
+    fprintf(stderr, "  dropped by rx filter     %10u\n", stats.filtered);
+    fprintf(stderr, "  dropped, rx buffer full  %10u\n", stats.overflow);
+    fprintf(stderr, "  lost in controller reset %10u\n", stats.lost_in_reset);
+    fprintf(stderr, "  read by the busmaster    %10u\n", stats.read);
+    fprintf(stderr, "    handled                %10u\n", stats.handled);
+    fprintf(stderr, "    ignored                %10u\n", stats.ignored);
+    fprintf(stderr, "frames transmitted         %10u\n", stats.tx_frames);
+    fprintf(stderr, "  looped back to us        %10u\n", stats.loopback);
+    fprintf(stderr, "  aborted                  %10u (%u times sent on without TXRST)\n",
+            stats.tx_aborted, stats.tx_unreset);
+    fprintf(stderr, "  changed while sending    %10u (ETXST/ETXND or the frame)\n", stats.tx_clobbered);
+    fprintf(stderr, "  dropped, queue full      %10u\n", enc28j60_tx_dropped);
+    fprintf(stderr, "frames sent to the bus     %10u\n", stats.bus_frames);
+    fprintf(stderr, "  commands from Ethernet   %10u (latency mean %.3f ms, max %.3f ms)\n", stats.commands,
+            stats.commands ? stats.latency_sum / mhz / 1e3 / stats.commands : 0.0, stats.latency_max / mhz / 1e3);
+    fprintf(stderr, "    low priority           %10u (latency mean %.3f ms, max %.3f ms)\n", stats.commands_low,
+            stats.commands_low ? stats.latency_low_sum / mhz / 1e3 / stats.commands_low : 0.0,
+            stats.latency_low_max / mhz / 1e3);
+    fprintf(stderr, "    dropped, queue full    %10u\n", downlink_dropped);
+    fprintf(stderr, "    dropped, invalid       %10u\n", downlink_invalid);
+    fprintf(stderr, "  pings                    %10u (%u to absent nodes, %u answered)\n",
+            stats.pings, stats.pings_absent, stats.pongs);
+    fprintf(stderr, "node events                %10u (%u lost, node queue full)\n", stats.events, stats.events_lost);
+    fprintf(stderr, "  fetched by the busmaster %10u (waited mean %.3f ms, max %.3f ms)\n", stats.events_fetched,
+            stats.events_fetched ? stats.event_wait_sum / mhz / 1e3 / stats.events_fetched : 0.0,
+            stats.event_wait_max / mhz / 1e3);
+    fprintf(stderr, "frames from the bus        %10u\n", stats.bus_in);
+    fprintf(stderr, "  sent to Ethernet         %10u (in %u datagrams, waited mean %.3f ms, max %.3f ms)\n",
+            stats.upstream, stats.upstream_datagrams,
+            stats.upstream ? stats.upstream_wait_sum / mhz / 1e3 / stats.upstream : 0.0,
+            stats.upstream_wait_max / mhz / 1e3);
+    fprintf(stderr, "  dropped, upstream full   %10u (at most %u queued)\n",
+            upstream_dropped, upstream_high_water);
+#ifdef BUS_MIRROR
+    fprintf(stderr, "  mirrored                 %10u bytes (in %u datagrams, %u lost)\n",
+            stats.mirror_bytes, stats.mirror_datagrams, mirror_lost);
+#endif
+    fprintf(stderr, "controller resets          %10u\n", stats.resets);
+    fprintf(stderr, "spi transactions           %10llu (%llu bytes)\n",
+            (unsigned long long)stats.spi_transactions, (unsigned long long)stats.spi_bytes);
+    fprintf(stderr, "  per main loop pass       %10.2f (%llu passes)\n",
+            stats.passes ? (double)stats.spi_transactions / stats.passes : 0.0,
+            (unsigned long long)stats.passes);
+    fprintf(stderr, "  controller interrupts    %10llu\n", (unsigned long long)stats.interrupts);
+    fprintf(stderr, "  switching banks          %10llu\n", (unsigned long long)stats.bank_switch_ops);
+    fprintf(stderr, "spi time                   %10.3f ms (%.2f %% of virtual time)\n",
+            stats.spi_cycles / mhz / 1e3, 100.0 * stats.spi_cycles / mock_cycles);
+    fprintf(stderr, "  on handled frames        %10.3f ms\n", stats.cycles_handled / mhz / 1e3);
+    fprintf(stderr, "  on ignored frames        %10.3f ms\n", stats.cycles_ignored / mhz / 1e3);
+    fprintf(stderr, "  polling and other        %10.3f ms\n",
+            (stats.spi_cycles - stats.cycles_handled - stats.cycles_ignored) / mhz / 1e3);
+
+    if (pcap_out != NULL)
+        fclose(pcap_out);
+}
+
+/* timer 1 compare match, the millisecond tick of main.c */
+static uint64_t timer_at = F_CPU / 1000;
+
+#ifdef BUS_MIRROR
+/* the RX interrupt for the bytes which arrived before 'until', with
+ * TCNT1 (prescaler 8) as it was then */
+static void wire_receive(uint64_t until) {
+    while (wire_count > 0 && wire[wire_head].at < until) {
+        TCNT1 = (wire[wire_head].at - (timer_at - F_CPU / 1000)) / 8;
+        TIFR1 = 0;
+        if (mirror_enabled)
+            stats.mirror_bytes++;
+        mirror_byte(wire[wire_head].c, (wire[wire_head].c & 0x100) ? MIRROR_ADDRESS : 0);
+        wire_head = (wire_head + 1) % WIRE_BYTES;
+        wire_count--;
+    }
+}
+#endif
+
+/* Called on every delay and sleep of the firmware, i.e. at least once per
+ * main loop pass. Runs the timer interrupt, delivers the input frames which
+ * are due and ends the simulation. */
+static void tick(void) {
+    window_close();
+
+    while (mock_cycles >= timer_at) {
+#ifdef BUS_MIRROR
+        wire_receive(timer_at);
+#endif
+        timer_at += F_CPU / 1000;
+        if (TIMSK1 & _BV(OCIE1A))
+            TIMER1_COMPA_vect();
+    }
+#ifdef BUS_MIRROR
+    wire_receive(mock_cycles + 1);
+#endif
+
+    enc_update();
+
+    if (!started) {
+        started = true;
+        start_cycles = mock_cycles;
+        read_next();
+    }
+
+    while (next_len >= 0 && mock_cycles >= next_at) {
+        enc_receive(next_frame, next_len, false);
+        read_next();
+    }
+
+    enc_interrupt();
+    node_events();
+
+    /* with -n, pings and pongs keep the Ethernet busy forever, only the
+     * events of the nodes count */
+    bool transmitting = (*reg(REG_ECON1) & _BV(ECON1_TXRTS)) && nodes_present == 0;
+
+    if (next_len >= 0 || enc.pktcnt > 0 || bus_pending > 0 || events_waiting() || mock_cycles < events_until ||
+        transmitting) {
+        idle_since = mock_cycles;
+        return;
+    }
+
+    if (mock_cycles - idle_since > DRAIN_CYCLES) {
+        report();
+        exit(0);
+    }
+}
+
+/* The main loop sleeps until the next interrupt: the timer tick, or INT2
+ * for the next input frame or the end of a transmission. */
+static void sleep_until_interrupt(void) {
+    uint64_t wake = timer_at;
+
+    stats.passes++;
+    /* USART receive interrupt for the answer of a node */
+    if (reply_ready && reply_at < wake)
+        wake = reply_at;
+#ifndef ENC28J60_POLL
+    if (started && next_len >= 0 && next_at < wake)
+        wake = next_at;
+    if ((*reg(REG_ECON1) & _BV(ECON1_TXRTS)) && enc.tx_done_at < wake)
+        wake = enc.tx_done_at;
+#endif
+    mock_delay_cycles(wake > mock_cycles ? wake - mock_cycles : 1);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-v] [-R revid] [-b bus frames] [-s stall ms:duration ms]\n"
+                    "          [-n nodes] [-e ms between events] [-t seconds] [-l %% pings lost]\n"
+                    "          [-a %% transmissions aborted]\n"
+                    "          [-r input.pcap] [-w output.pcap]\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+
+    while ((c = getopt(argc, argv, "r:w:vR:b:s:n:e:t:l:a:")) != -1) {
+        switch (c) {
+        case 'r':
+            pcap_open_in(optarg);
+            break;
+        case 'w':
+            pcap_open_out(optarg);
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        case 'R':
+            revision = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            bus_pending = strtoul(optarg, NULL, 0);
+            break;
+        case 's': {
+            char *end;
+            stall_from = strtoul(optarg, &end, 0) * (F_CPU / 1000);
+            if (*end == ':')
+                stall_until = stall_from + strtoul(end + 1, NULL, 0) * (F_CPU / 1000);
+            break;
+        }
+        case 'n':
+            nodes_present = atoi(optarg);
+            if (nodes_present > MAX_NODES)
+                nodes_present = MAX_NODES;
+            break;
+        case 'e':
+            event_cycles = strtoul(optarg, NULL, 0) * (F_CPU / 1000);
+            break;
+        case 't':
+            events_until = strtoul(optarg, NULL, 0) * F_CPU;
+            break;
+        case 'l':
+            ping_loss = atof(optarg) / 100;
+            break;
+        case 'a':
+            tx_abort_rate = atof(optarg) / 100;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    enc_reset();
+    for (uint8_t n = 1; n <= nodes_present && event_cycles > 0; n++) {
+        node[n].seed = n;
+        node[n].next_event = event_gap(n);
+    }
+    mock_delay_hook = tick;
+    mock_sleep_hook = sleep_until_interrupt;
+
+    return busmaster_main(argc, argv);
+}
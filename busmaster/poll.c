@@ -0,0 +1,132 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * Decides which node the busmaster pings next.
+ *
+ * Every ping keeps the bus busy for MSG_WAIT_MS (main.c), so with a full
+ * segment the ping slots are the scarce resource. Each node has a deadline
+ * for its next ping, the slot goes to the node which is overdue the longest:
+ *
+ *   - a node which answers is pinged every POLL_MS
+ *   - a node which reported waiting frames is pinged every POLL_ACTIVE_MS
+ *     for the next POLL_ACTIVE_PINGS pings, events tend to come in bursts
+ *   - a single missing pong is retried after POLL_MS, every further one
+ *     doubles the interval, up to POLL_ABSENT_MS for nodes which are not
+ *     there at all
+ *
+ */
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "poll.h"
+
+#define POLL_MS 500
+#define POLL_ACTIVE_MS 100
+#define POLL_ACTIVE_PINGS 20
+#define POLL_ABSENT_MS 8000
+
+/* time until the next ping to a node which just got a command */
+#define POLL_AFTER_COMMAND_MS 150
+
+/* POLL_MS << (POLL_MAX_MISSES - 1) == POLL_ABSENT_MS */
+#define POLL_MAX_MISSES 5
+
+#define NODES (POLL_LAST_NODE - POLL_FIRST_NODE + 1)
+
+static struct {
+    /* next ping is due at this time */
+    uint16_t next;
+    /* pongs missed in a row, up to POLL_MAX_MISSES */
+    uint8_t misses;
+    /* pings left at POLL_ACTIVE_MS */
+    uint8_t active;
+} nodes[NODES];
+
+/* node which was pinged last and did not answer yet, 0 if none */
+static uint8_t polled;
+
+static bool valid(uint8_t node) {
+    return node >= POLL_FIRST_NODE && node <= POLL_LAST_NODE;
+}
+
+static uint16_t interval(uint8_t i) {
+    if (nodes[i].misses > 0)
+        return POLL_MS << (nodes[i].misses - 1);
+    if (nodes[i].active > 0)
+        return POLL_ACTIVE_MS;
+    return POLL_MS;
+}
+
+void poll_init(uint16_t now) {
+    /* the first round probes every address, a node missing its first
+     * ping (or not there) backs off from there */
+    for (uint8_t i = 0; i < NODES; i++) {
+        nodes[i].next = now;
+        nodes[i].misses = 1;
+        nodes[i].active = 0;
+    }
+    polled = 0;
+}
+
+uint8_t poll_next(uint16_t now) {
+    /* the answer window of the last ping is over */
+    if (polled != 0) {
+        uint8_t i = polled - POLL_FIRST_NODE;
+        if (nodes[i].misses < POLL_MAX_MISSES)
+            nodes[i].misses++;
+        nodes[i].active = 0;
+        nodes[i].next = now + interval(i);
+        polled = 0;
+    }
+
+    uint8_t best = 0;
+    int16_t overdue = -1;
+    for (uint8_t i = 0; i < NODES; i++) {
+        int16_t late = (int16_t)(now - nodes[i].next);
+        if (late > overdue) {
+            overdue = late;
+            best = POLL_FIRST_NODE + i;
+        }
+    }
+    return best;
+}
+
+void poll_sent(uint8_t node, uint16_t now) {
+    if (!valid(node))
+        return;
+
+    uint8_t i = node - POLL_FIRST_NODE;
+    if (nodes[i].active > 0)
+        nodes[i].active--;
+    nodes[i].next = now + interval(i);
+    polled = node;
+}
+
+bool poll_pong(uint8_t node, uint8_t pending, uint16_t now) {
+    if (!valid(node))
+        return false;
+
+    uint8_t i = node - POLL_FIRST_NODE;
+    /* a late pong (after poll_next() counted it as missing) counts, too */
+    if (nodes[i].misses > 0) {
+        nodes[i].misses = 0;
+        nodes[i].next = now + interval(i);
+    }
+    if (pending > 0) {
+        nodes[i].active = POLL_ACTIVE_PINGS;
+        nodes[i].next = now + POLL_ACTIVE_MS;
+    }
+    if (polled != node)
+        return false;
+    polled = 0;
+    return true;
+}
+
+void poll_command(uint8_t node, uint16_t now) {
+    if (!valid(node))
+        return;
+
+    uint8_t i = node - POLL_FIRST_NODE;
+    if ((int16_t)(nodes[i].next - now) > POLL_AFTER_COMMAND_MS)
+        nodes[i].next = now + POLL_AFTER_COMMAND_MS;
+}
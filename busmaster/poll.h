@@ -0,0 +1,29 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ */
+#ifndef _POLL_H
+#define _POLL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* bus addresses of the nodes, see README in the top directory */
+#define POLL_FIRST_NODE 1
+#define POLL_LAST_NODE 29
+
+void poll_init(uint16_t now);
+
+/* node to ping next, 0 if no node is due */
+uint8_t poll_next(uint16_t now);
+
+/* a ping went out to 'node' */
+void poll_sent(uint8_t node, uint16_t now);
+
+/* 'node' answered a ping, 'pending' frames are waiting on it. True if
+ * this is the answer to the last ping. */
+bool poll_pong(uint8_t node, uint8_t pending, uint16_t now);
+
+/* a command from Ethernet went out to 'node', it may have an answer soon */
+void poll_command(uint8_t node, uint16_t now);
+
+#endif
@@ -0,0 +1,346 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * Simulates the receive side of the busmaster on a noisy segment: nodes
+ * answer with frames, every character runs through ISR(USART0_RX_vect) of
+ * lib/uart.c, and a main loop like the one in busmaster/main.c takes frames
+ * out of the ringbuffer every few milliseconds.
+ *
+ * Fault models:
+ *   -e  bit error rate: every bit on the wire flips with this probability
+ *       (a flipped stop bit is a framing error, flipped bit 8 changes the
+ *       address flag)
+ *   -B  noise bursts per second, -L mean burst length in characters; during
+ *       a burst every bit flips with probability 1/2
+ *   -s  probability that a character loses its stop bit (FE is raised)
+ *   -d  probability that a node stops responding in the middle of a frame
+ *
+ * The report shows goodput, how long it takes to receive a correct frame
+ * again after a fault (time to resynchronise) and how often the ringbuffer
+ * overflow in lib/uart.c reset the MCU through the watchdog.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <math.h>
+#include <unistd.h>
+
+#include <avr/io.h>
+#include <mockusart.h>
+
+/* included, not linked, so a watchdog reset can clear its static state */
+#include "uart.c"
+
+extern void (*mock_wdt_hook)(void);
+
+static jmp_buf watchdog;
+
+static void watchdog_fired(void) {
+    longjmp(watchdog, 1);
+}
+
+/* what the MCU looks like after a reset: empty ringbuffer, fresh USART */
+static void mcu_reset(void) {
+    memset((void *)uartbuf, 0, sizeof(uartbuf));
+    uartwrite = 0;
+    uartread = 0;
+    errflag = 0;
+    status = BUS_STATUS_IDLE;
+    txcnt = 0;
+    UCSR0A = _BV(UDRE0);
+    UCSR0B = 0;
+    net_init();
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * parameters
+ *
+ */
+
+static struct {
+    long baud;
+    unsigned long frames;
+    uint8_t len;
+    double ber;
+    double burst_rate;
+    double burst_len;
+    double stopbit;
+    double dropout;
+    double loop_ms;
+    double gap_ms;
+    double reboot_ms;
+    bool drain;
+} p = {
+    .baud = 38400,
+    .frames = 10000,
+    .len = 8,
+    .burst_len = 20,
+    .loop_ms = 10,
+    .gap_ms = 20,
+    .reboot_ms = 50,
+};
+
+static double uniform(void) {
+    return rand() / (RAND_MAX + 1.0);
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * statistics
+ *
+ */
+
+static struct {
+    unsigned long sent;
+    unsigned long truncated;
+    unsigned long chars;
+    unsigned long corrupted_chars;
+    unsigned long framing_errors;
+    unsigned long bursts;
+    unsigned long good;
+    unsigned long good_bytes;
+    unsigned long bad_accepted;
+    unsigned long crc_skips;
+    unsigned long watchdog_resets;
+    unsigned long lost_in_reboot;
+    unsigned long resyncs;
+    double resync_sum;
+    double resync_max;
+} st;
+
+/* time of the first fault since the last correctly received frame, < 0 if
+ * there was none */
+static double fault_since = -1;
+
+static void fault(double t) {
+    if (fault_since < 0)
+        fault_since = t;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * the busmaster
+ *
+ */
+
+static double now_ms;
+static double reboot_until = -1;
+static uint8_t expected[32];
+
+/* builds the frame with sequence number 'seq', as node (seq % 29) + 1 */
+static uint8_t make_frame(uint8_t *buf, unsigned long seq) {
+    uint8_t payload[32];
+    for (uint8_t c = 0; c < p.len; c++)
+        payload[c] = (uint8_t)(seq >> (8 * (c % 4))) ^ (c * 0x35);
+    fmt_packet(buf, 0, (seq % 29) + 1, payload, p.len);
+    return sizeof(struct buspkt) + p.len;
+}
+
+static void check_frame(struct buspkt *packet) {
+    uint8_t *payload = (uint8_t *)packet + sizeof(struct buspkt);
+
+    /* find the frame by the sequence number in the first bytes */
+    unsigned long seq = 0;
+    for (uint8_t c = 0; c < 4 && c < p.len; c++)
+        seq |= (unsigned long)(payload[c] ^ (c * 0x35)) << (8 * c);
+
+    uint8_t size = make_frame(expected, seq);
+    if (packet->length_lo == p.len && memcmp(packet, expected, size) == 0) {
+        st.good++;
+        st.good_bytes += p.len;
+        if (fault_since >= 0) {
+            double took = now_ms - fault_since;
+            st.resyncs++;
+            st.resync_sum += took;
+            if (took > st.resync_max)
+                st.resync_max = took;
+            fault_since = -1;
+        }
+    } else {
+        st.bad_accepted++;
+    }
+}
+
+/* one pass of the busmaster main loop (without the network part) */
+static void main_loop_pass(void) {
+    do {
+        uint8_t s = bus_status();
+        if (s == BUS_STATUS_IDLE)
+            return;
+
+        if (s == BUS_STATUS_MESSAGE) {
+            check_frame(current_packet());
+            packet_done();
+        } else if (s == BUS_STATUS_WRONG_CRC) {
+            st.crc_skips++;
+            skip_byte();
+        } else {
+            return;
+        }
+    } while (p.drain);
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * the wire
+ *
+ */
+
+static double next_loop_ms;
+static unsigned long burst_chars;
+
+/* runs the main loop passes which are due before time 't' */
+static void advance(double t) {
+    while (next_loop_ms <= t) {
+        now_ms = next_loop_ms;
+        if (now_ms >= reboot_until)
+            main_loop_pass();
+        next_loop_ms += p.loop_ms;
+    }
+    now_ms = t;
+}
+
+/* puts one character on the wire, applying the fault models */
+static void wire_char(uint16_t sent, double t, double char_ms) {
+    uint16_t c = sent;
+    uint8_t errors = 0;
+
+    st.chars++;
+    advance(t);
+
+    if (burst_chars == 0 && p.burst_rate > 0 && uniform() < p.burst_rate * char_ms / 1000.0) {
+        st.bursts++;
+        burst_chars = 1 + (unsigned long)(-p.burst_len * log(1.0 - uniform()));
+    }
+
+    double ber = (burst_chars > 0 ? 0.5 : p.ber);
+    if (burst_chars > 0)
+        burst_chars--;
+
+    if (ber > 0) {
+        /* start bit, 9 data bits, stop bit */
+        for (uint8_t bit = 0; bit < 11; bit++) {
+            if (uniform() >= ber)
+                continue;
+            if (bit == 0 || bit == 10)
+                errors |= _BV(FE0);
+            else c ^= 1 << (bit - 1);
+        }
+    }
+
+    if (p.stopbit > 0 && uniform() < p.stopbit)
+        errors |= _BV(FE0);
+
+    if (errors)
+        st.framing_errors++;
+    if (errors || c != sent) {
+        st.corrupted_chars++;
+        fault(t);
+    }
+
+    if (t < reboot_until) {
+        st.lost_in_reboot++;
+        return;
+    }
+
+    if (setjmp(watchdog) != 0) {
+        st.watchdog_resets++;
+        fault(t);
+        reboot_until = t + p.reboot_ms;
+        mcu_reset();
+        return;
+    }
+
+    mock_usart0_receive(c, errors);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-b baud] [-n frames] [-l payload length] [-e bit error rate]\n"
+                    "          [-B bursts/s] [-L burst length] [-s stop bit loss] [-d node dropout]\n"
+                    "          [-m main loop ms] [-g gap between frames ms] [-r reboot ms] [-D] [-S seed]\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+
+    while ((c = getopt(argc, argv, "b:n:l:e:B:L:s:d:m:g:r:DS:")) != -1) {
+        switch (c) {
+        case 'b': p.baud = atol(optarg); break;
+        case 'n': p.frames = strtoul(optarg, NULL, 0); break;
+        case 'l': p.len = atoi(optarg); break;
+        case 'e': p.ber = atof(optarg); break;
+        case 'B': p.burst_rate = atof(optarg); break;
+        case 'L': p.burst_len = atof(optarg); break;
+        case 's': p.stopbit = atof(optarg); break;
+        case 'd': p.dropout = atof(optarg); break;
+        case 'm': p.loop_ms = atof(optarg); break;
+        case 'g': p.gap_ms = atof(optarg); break;
+        case 'r': p.reboot_ms = atof(optarg); break;
+        case 'D': p.drain = true; break;
+        case 'S': srand(atoi(optarg)); break;
+        default: usage(argv[0]);
+        }
+    }
+
+    /* the frame has to fit into the ringbuffer, the sequence number into
+     * the payload */
+    if (p.len > UARTBUF - sizeof(struct buspkt) - 1)
+        p.len = UARTBUF - sizeof(struct buspkt) - 1;
+    if (p.len < 4)
+        p.len = 4;
+
+    mock_wdt_hook = watchdog_fired;
+    mcu_reset();
+
+    double char_ms = 11 * 1000.0 / p.baud;
+    double t = 0;
+    uint8_t frame[32];
+
+    for (unsigned long seq = 0; seq < p.frames; seq++) {
+        uint8_t size = make_frame(frame, seq);
+        uint8_t send = size;
+
+        if (p.dropout > 0 && uniform() < p.dropout) {
+            send = (uint8_t)(uniform() * size);
+            st.truncated++;
+        }
+
+        for (uint8_t i = 0; i < send; i++, t += char_ms)
+            wire_char(frame[i] | (i == 0 ? 0x100 : 0), t, char_ms);
+
+        /* the fault starts when the frame breaks off, not before: the
+         * receiver may still complete an earlier frame meanwhile */
+        if (send < size)
+            fault(t);
+
+        st.sent++;
+        t += p.gap_ms;
+    }
+    advance(t + 10 * p.loop_ms);
+
+    double seconds = t / 1000.0;
+    printf("baud rate                %ld (%.3f ms per character)\n", p.baud, char_ms);
+    printf("simulated time           %.3f s\n", seconds);
+    printf("frames sent              %lu (%lu truncated by node dropout)\n", st.sent, st.truncated);
+    printf("characters on the wire   %lu (%lu corrupted, %lu framing errors, %lu noise bursts)\n",
+           st.chars, st.corrupted_chars, st.framing_errors, st.bursts);
+    printf("frames received correctly %lu (%.2f %%)\n", st.good, 100.0 * st.good / st.sent);
+    printf("frames accepted corrupted %lu\n", st.bad_accepted);
+    printf("header checksum skips    %lu\n", st.crc_skips);
+    printf("goodput                  %.1f payload bytes/s (offered %.1f)\n",
+           st.good_bytes / seconds, st.sent * p.len / seconds);
+    printf("watchdog resets          %lu (%lu characters lost while rebooting)\n",
+           st.watchdog_resets, st.lost_in_reboot);
+    printf("time to resynchronise    %lu times, mean %.2f ms, max %.2f ms\n",
+           st.resyncs, st.resyncs ? st.resync_sum / st.resyncs : 0.0, st.resync_max);
+    if (fault_since >= 0)
+        printf("                         still not resynchronised after %.2f ms\n", now_ms - fault_since);
+
+    return 0;
+}
@@ -0,0 +1,754 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * Simulates a building with many bus segments, each with its own busmaster,
+ * all joined on one Ethernet. Every segment models the scheduler of
+ * busmaster/main.c (commands from the downlink queue, send requests, pings
+ * by deadline as in poll.c, each at the next frame boundary, frames from
+ * the bus forwarded as multicast, health reports), the receive filter of
+ * the ENC28J60 and the nodes on its bus, which collect messages until they
+ * are polled. Low priority (CS1) commands, telemetry, the bus mirror,
+ * UPSTREAM_AGGREGATE_MS and nodes which do not answer are not modelled.
+ *
+ * The firmware keeps its state in globals, so the segments are models and
+ * not copies of the firmware. That makes them cheap enough to simulate a
+ * whole day of a building in a few minutes.
+ *
+ * Segments are spread over a pool of worker threads. Time advances in
+ * epochs (-E, default 10 ms); at the end of an epoch all workers meet at
+ * a barrier. Ethernet frames a segment sends travel over
+ * lock-free single-producer/single-consumer queues, one per worker and
+ * destination segment, and arrive at the start of the next epoch. The
+ * queues are double buffered by epoch parity, so a consumer can drain the
+ * frames of the last epoch while the producers already fill the other half.
+ * Frames are sorted before delivery, the results do not depend on the
+ * number of threads.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+/* ENC28J60 receive buffer below TXBUFFER_START, see busmaster/enc28j60.h */
+#define ENC_RXBUFFER 0x1000
+#define ENC_FIFO 128
+
+/* Ethernet + IPv6 + UDP header in front of the payload, see main.c */
+#define ETH_HEADER 62
+
+/* messages a node can hold until it is polled */
+#define NODE_QUEUE 16
+
+/* timing of busmaster/main.c, poll.c and health.c */
+#define MSG_WAIT_MS 15
+#define ANSWER_GAP_MS 2
+#define SEND_SPACING_MS 25
+#define DOWNLINK_QUEUE 8
+#define POLL_ACTIVE_MS 100
+#define POLL_ACTIVE_PINGS 20
+#define POLL_AFTER_COMMAND_MS 150
+#define HEALTH_REPORT_S 10
+
+#define QUEUE_SIZE 4096
+
+#define MAX_NODES 254
+
+/*
+ * ----------------------------------------------------------------------
+ * parameters
+ *
+ */
+
+static struct {
+    unsigned segments;
+    unsigned nodes;
+    double seconds;
+    unsigned threads;
+    uint64_t epoch_us;
+    double rate;
+    double commands;
+    unsigned poll;
+    unsigned groups;
+    unsigned forwarded;
+    long baud;
+    uint8_t len;
+    unsigned seed;
+    bool verbose;
+} p = {
+    .segments = 20,
+    .nodes = 29,
+    .seconds = 86400,
+    .epoch_us = 10000,
+    .rate = 60,
+    .commands = 0.1,
+    .poll = 500,
+    .groups = 10,
+    .forwarded = 1,
+    .baud = 38400,
+    .len = 8,
+    .seed = 1,
+};
+
+/* time for 'chars' characters on the bus in microseconds */
+static uint64_t bus_us(unsigned chars) {
+    return (uint64_t)chars * 11 * 1000000 / p.baud;
+}
+
+/* per byte of a received frame: RBM opcode and data byte on the SPI bus */
+#define SPI_US_PER_BYTE 2
+
+/* bytes a frame takes in the ENC28J60 receive buffer: next packet pointer,
+ * status vector, frame, CRC, padded to an even address */
+static unsigned enc_size(unsigned len) {
+    return (2 + 4 + len + 4 + 1) & ~1;
+}
+
+static uint64_t xorshift(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static double uniform(uint64_t *state) {
+    return (xorshift(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * Ethernet frames and the queues between the workers
+ *
+ */
+
+enum { FRAME_MULTICAST, FRAME_COMMAND };
+
+struct frame {
+    uint64_t t;
+    /* when the message causing this frame was created on its node */
+    uint64_t origin;
+    uint32_t seq;
+    uint16_t src;
+    /* the segment a command is meant for */
+    uint16_t target;
+    uint8_t dst_node;
+    /* multicast group of a frame from the bus */
+    uint8_t group;
+    uint8_t kind;
+    uint16_t len;
+};
+
+struct queue {
+    _Atomic uint32_t head __attribute__((aligned(64)));
+    _Atomic uint32_t tail __attribute__((aligned(64)));
+    struct frame ring[QUEUE_SIZE];
+};
+
+static bool queue_push(struct queue *q, const struct frame *f) {
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (tail - head == QUEUE_SIZE)
+        return false;
+    q->ring[tail % QUEUE_SIZE] = *f;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+static bool queue_pop(struct queue *q, struct frame *f) {
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (head == tail)
+        return false;
+    *f = q->ring[head % QUEUE_SIZE];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return true;
+}
+
+/* queues[parity][worker][segment] */
+static struct queue *queues[2];
+
+static struct queue *queue_for(unsigned parity, unsigned worker, unsigned segment) {
+    return &queues[parity][worker * p.segments + segment];
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * segments
+ *
+ */
+
+struct node {
+    uint64_t next_message;
+    uint64_t queue[NODE_QUEUE];
+    uint8_t queue_head;
+    uint8_t queue_len;
+    /* poll.c: next ping is due at this time, pings left at POLL_ACTIVE_MS */
+    uint64_t next_ping;
+    uint8_t active;
+};
+
+enum { RESPONSE_NONE, RESPONSE_PONG, RESPONSE_MESSAGE };
+
+struct stats {
+    unsigned long passes;
+    unsigned long pings;
+    unsigned long messages;
+    unsigned long node_drops;
+    uint64_t message_latency_sum;
+    uint64_t message_latency_max;
+    unsigned long multicasts;
+    unsigned long enc_frames;
+    unsigned long enc_drops;
+    unsigned long enc_filtered;
+    unsigned long enc_max;
+    unsigned long commands;
+    unsigned long foreign_commands;
+    unsigned long group_frames;
+    uint64_t command_latency_sum;
+    uint64_t command_latency_max;
+    uint64_t bus_busy;
+    unsigned long queue_full;
+};
+
+struct segment {
+    unsigned id;
+    unsigned worker;
+    uint64_t rng;
+    uint64_t t;
+    uint32_t seq;
+    /* queue half for the epoch the worker is in */
+    unsigned parity;
+
+    /* state of main.c */
+    uint64_t bus_free_at;
+    bool sendreq;
+    uint8_t burst_remain;
+    uint8_t burst_sender;
+    uint64_t report_at;
+
+    /* commands and group frames waiting for the bus (DOWNLINK_QUEUE) */
+    struct frame downlink[DOWNLINK_QUEUE];
+    unsigned downlink_count;
+
+    /* the frame the busmaster is waiting for and when it is complete */
+    uint8_t response;
+    uint8_t response_node;
+    uint64_t response_at;
+
+    /* frames in the ENC28J60 receive buffer */
+    struct frame enc[ENC_FIFO];
+    unsigned enc_head;
+    unsigned enc_count;
+    unsigned enc_bytes;
+
+    struct node nodes[MAX_NODES];
+    struct stats st;
+};
+
+static struct segment *segments;
+
+/* delivers a frame, the owner of the destination picks it up next epoch */
+static void emit(struct segment *s, unsigned dst, const struct frame *f) {
+    if (!queue_push(queue_for(s->parity, s->worker, dst), f))
+        s->st.queue_full++;
+}
+
+static struct frame make_frame(struct segment *s, uint8_t kind, unsigned len, uint64_t origin) {
+    struct frame f = {
+        .t = s->t,
+        .origin = origin,
+        .seq = s->seq++,
+        .src = s->id,
+        .kind = kind,
+        .len = len,
+    };
+    return f;
+}
+
+/* a frame from the bus to ff05::b5:<group>, it reaches every other
+ * busmaster, their receive filter decides */
+static void multicast(struct segment *s, uint8_t group, unsigned payload_len, uint64_t origin) {
+    struct frame f = make_frame(s, FRAME_MULTICAST, ETH_HEADER + payload_len, origin);
+
+    f.group = group;
+    s->st.multicasts++;
+    for (unsigned d = 0; d < p.segments; d++)
+        if (d != s->id)
+            emit(s, d, &f);
+}
+
+/* the hash and pattern filter of busmaster/enc28j60.c: of the multicasts
+ * only the groups in ENC28J60_FILTER_GROUPS, taken as 50 and up */
+static bool enc_accepts(const struct frame *f) {
+    return f->kind != FRAME_MULTICAST || (f->group >= 50 && f->group < 50 + p.forwarded);
+}
+
+static void enc_receive(struct segment *s, const struct frame *f) {
+    unsigned size = enc_size(f->len);
+
+    if (!enc_accepts(f)) {
+        s->st.enc_filtered++;
+        return;
+    }
+    if (s->enc_count == ENC_FIFO || s->enc_bytes + size > ENC_RXBUFFER) {
+        s->st.enc_drops++;
+        return;
+    }
+    s->enc[(s->enc_head + s->enc_count++) % ENC_FIFO] = *f;
+    s->enc_bytes += size;
+    if (s->enc_count > s->st.enc_max)
+        s->st.enc_max = s->enc_count;
+}
+
+/* lets the messages of a node arrive up to now, nodes are only looked at
+ * when they are polled */
+static void node_update(struct segment *s, struct node *n) {
+    double per_us = p.rate / 3600e6;
+
+    while (n->next_message <= s->t) {
+        if (n->queue_len == NODE_QUEUE)
+            s->st.node_drops++;
+        else n->queue[(n->queue_head + n->queue_len++) % NODE_QUEUE] = n->next_message;
+        n->next_message += (uint64_t)(-log(1.0 - uniform(&s->rng)) / per_us) + 1;
+    }
+}
+
+/* send_packet() to a node, which answers after a turnaround of 1 ms */
+static void bus_request(struct segment *s, uint8_t node, uint8_t payload_len, uint8_t response, uint8_t response_len) {
+    uint64_t request = bus_us(6 + payload_len);
+    uint64_t answer = bus_us(6 + response_len);
+
+    s->st.bus_busy += request + answer;
+    s->response = response;
+    s->response_node = node;
+    s->response_at = s->t + request + 1000 + answer;
+}
+
+/* poll.c: the node which is overdue the longest, 0 if none is due */
+static uint8_t poll_next(struct segment *s) {
+    uint8_t best = 0;
+
+    for (unsigned i = 0; i < p.nodes; i++)
+        if (s->nodes[i].next_ping <= s->t &&
+            (best == 0 || s->nodes[i].next_ping < s->nodes[best - 1].next_ping))
+            best = i + 1;
+    return best;
+}
+
+static void poll_sent(struct segment *s, struct node *n) {
+    if (n->active > 0)
+        n->active--;
+    n->next_ping = s->t + (n->active > 0 ? POLL_ACTIVE_MS : p.poll) * 1000;
+}
+
+/* command_send(): the oldest command or group frame goes on the bus */
+static void command_send(struct segment *s) {
+    struct frame f = s->downlink[0];
+    uint64_t on_bus = bus_us(6 + f.len - ETH_HEADER);
+
+    memmove(s->downlink, s->downlink + 1, --s->downlink_count * sizeof(struct frame));
+    s->st.bus_busy += on_bus;
+    s->bus_free_at = s->t + SEND_SPACING_MS * 1000;
+
+    if (f.kind == FRAME_MULTICAST) {
+        s->st.group_frames++;
+        return;
+    }
+
+    /* all busmasters share one MAC address, each forwards it */
+    if (f.target != s->id) {
+        s->st.foreign_commands++;
+        return;
+    }
+    uint64_t took = s->t + on_bus - f.origin;
+    s->st.commands++;
+    s->st.command_latency_sum += took;
+    if (took > s->st.command_latency_max)
+        s->st.command_latency_max = took;
+
+    /* poll_command(): the node is pinged soon after */
+    struct node *n = &s->nodes[f.dst_node - 1];
+    if (n->next_ping > s->t + POLL_AFTER_COMMAND_MS * 1000)
+        n->next_ping = s->t + POLL_AFTER_COMMAND_MS * 1000;
+}
+
+/* a pong or a message from the node the busmaster waited for */
+static void bus_answer(struct segment *s) {
+    uint8_t node = s->response_node;
+    struct node *n = &s->nodes[node - 1];
+    uint8_t response = s->response;
+
+    s->response = RESPONSE_NONE;
+    node_update(s, n);
+
+    if (response == RESPONSE_PONG) {
+        if (n->queue_len > 0) {
+            s->burst_remain = n->queue_len - 1;
+            s->burst_sender = node;
+            s->sendreq = true;
+            s->bus_free_at = s->t + SEND_SPACING_MS * 1000;
+            n->active = POLL_ACTIVE_PINGS;
+            n->next_ping = s->t + POLL_ACTIVE_MS * 1000;
+        } else if (s->bus_free_at > s->t + ANSWER_GAP_MS * 1000) {
+            s->bus_free_at = s->t + ANSWER_GAP_MS * 1000;
+        }
+        /* every frame from the bus is forwarded, the pong to group 0 */
+        multicast(s, 0, 5, s->t);
+        return;
+    }
+
+    if (n->queue_len == 0) {
+        s->burst_remain = 0;
+        return;
+    }
+
+    uint64_t origin = n->queue[n->queue_head];
+    n->queue_head = (n->queue_head + 1) % NODE_QUEUE;
+    n->queue_len--;
+
+    if (node == s->burst_sender && s->burst_remain > 0) {
+        s->burst_remain--;
+        s->sendreq = true;
+        s->bus_free_at = s->t + SEND_SPACING_MS * 1000;
+    } else {
+        s->burst_sender = 0;
+        s->burst_remain = 0;
+    }
+
+    uint64_t took = s->t - origin;
+    s->st.messages++;
+    s->st.message_latency_sum += took;
+    if (took > s->st.message_latency_max)
+        s->st.message_latency_max = took;
+    multicast(s, 50 + xorshift(&s->rng) % p.groups, p.len, origin);
+
+    /* the controller reacts on some messages with a command for a node
+     * anywhere in the building, sent to the busmaster MAC address */
+    if (uniform(&s->rng) < p.commands) {
+        struct frame f = make_frame(s, FRAME_COMMAND, ETH_HEADER + p.len, origin);
+        f.target = xorshift(&s->rng) % p.segments;
+        f.dst_node = 1 + xorshift(&s->rng) % p.nodes;
+        for (unsigned d = 0; d < p.segments; d++)
+            emit(s, d, &f);
+    }
+}
+
+/* One wakeup of the main loop in busmaster/main.c, in its order, then
+ * time advances to whatever can happen next (at most 'until'): the bus
+ * becoming free for waiting work, the answer of a node, the next ping
+ * deadline, the next health report or a frame in the receive buffer. */
+static void pass(struct segment *s, uint64_t until) {
+    s->st.passes++;
+
+    /* network_process(), one frame at a time; with the downlink queue full
+     * it stays in the receive buffer */
+    while (s->enc_count > 0 && s->enc[s->enc_head].t <= s->t && s->downlink_count < DOWNLINK_QUEUE) {
+        struct frame *f = &s->enc[s->enc_head];
+        s->enc_head = (s->enc_head + 1) % ENC_FIFO;
+        s->enc_count--;
+        s->enc_bytes -= enc_size(f->len);
+        s->st.enc_frames++;
+        s->t += f->len * SPI_US_PER_BYTE;
+        s->downlink[s->downlink_count++] = *f;
+    }
+
+    bool ready = s->t >= s->bus_free_at && s->response == RESPONSE_NONE;
+    uint8_t node;
+
+    if (ready && s->downlink_count > 0) {
+        command_send(s);
+    } else if (ready && s->sendreq) {
+        bus_request(s, s->burst_sender, 4, RESPONSE_MESSAGE, p.len);
+        s->bus_free_at = s->t + SEND_SPACING_MS * 1000;
+        s->sendreq = false;
+    } else if (ready && (node = poll_next(s)) != 0) {
+        bus_request(s, node, 4, RESPONSE_PONG, 5);
+        s->bus_free_at = s->t + MSG_WAIT_MS * 1000;
+        poll_sent(s, &s->nodes[node - 1]);
+        s->st.pings++;
+    }
+
+    /* health_report(), ten nodes per datagram to ff05::b5:fe */
+    if (s->t >= s->report_at) {
+        for (unsigned i = 0; i < p.nodes; i += 10)
+            multicast(s, 0xfe, 8 + 12 * (p.nodes - i < 10 ? p.nodes - i : 10), s->t);
+        s->report_at += HEALTH_REPORT_S * 1000000ULL;
+    }
+
+    if (s->response != RESPONSE_NONE && s->response_at <= s->t)
+        bus_answer(s);
+
+    uint64_t next = s->report_at;
+    if (s->response != RESPONSE_NONE && s->response_at < next)
+        next = s->response_at;
+    if (s->enc_count > 0 && s->downlink_count < DOWNLINK_QUEUE && s->enc[s->enc_head].t < next)
+        next = s->enc[s->enc_head].t;
+    uint64_t work = (s->downlink_count > 0 || s->sendreq) ? s->t : UINT64_MAX;
+    for (unsigned i = 0; i < p.nodes; i++)
+        if (s->nodes[i].next_ping < work)
+            work = s->nodes[i].next_ping;
+    if (work != UINT64_MAX) {
+        if (s->bus_free_at > work)
+            work = s->bus_free_at;
+        if (s->response != RESPONSE_NONE && s->response_at > work)
+            work = s->response_at;
+        if (work < next)
+            next = work;
+    }
+    if (next > until)
+        next = until;
+    if (next > s->t)
+        s->t = next;
+}
+
+static void segment_init(struct segment *s, unsigned id, unsigned worker) {
+    memset(s, 0, sizeof(*s));
+    s->id = id;
+    s->worker = worker;
+    s->rng = 0x9e3779b97f4a7c15ULL * (p.seed + 1) + id * 0x2545f4914f6cdd1dULL;
+    if (s->rng == 0)
+        s->rng = 1;
+    /* the busmasters were not all switched on at the same time, poll_init()
+     * makes every node due at once */
+    uint64_t boot = xorshift(&s->rng) % (p.poll * 1000);
+    s->report_at = boot + HEALTH_REPORT_S * 1000000ULL;
+    for (unsigned i = 0; i < p.nodes; i++) {
+        s->nodes[i].next_message = (uint64_t)(-log(1.0 - uniform(&s->rng)) / (p.rate / 3600e6)) + 1;
+        s->nodes[i].next_ping = boot;
+    }
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * workers
+ *
+ */
+
+static uint64_t end_us;
+
+/* An epoch is only a few wakeups of every segment, much shorter than a
+ * pthread_barrier_wait() sleeping and waking up. Workers spin on the
+ * generation counter instead and only yield when there are more workers
+ * than cores. */
+static struct {
+    _Atomic unsigned waiting __attribute__((aligned(64)));
+    _Atomic unsigned generation __attribute__((aligned(64)));
+} barrier;
+
+static void barrier_wait(void) {
+    unsigned generation = atomic_load_explicit(&barrier.generation, memory_order_acquire);
+
+    if (atomic_fetch_add_explicit(&barrier.waiting, 1, memory_order_acq_rel) == p.threads - 1) {
+        atomic_store_explicit(&barrier.waiting, 0, memory_order_relaxed);
+        atomic_store_explicit(&barrier.generation, generation + 1, memory_order_release);
+        return;
+    }
+
+    for (unsigned spins = 0; atomic_load_explicit(&barrier.generation, memory_order_acquire) == generation; spins++)
+        if (spins > 1000)
+            sched_yield();
+}
+
+static int frame_cmp(const void *a, const void *b) {
+    const struct frame *x = a, *y = b;
+
+    if (x->t != y->t)
+        return x->t < y->t ? -1 : 1;
+    if (x->src != y->src)
+        return x->src < y->src ? -1 : 1;
+    return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+/* moves the frames sent to 's' in the last epoch into its ENC28J60, in the
+ * same order no matter which worker sent them */
+static void deliver(struct segment *s, unsigned parity, struct frame **batch, size_t *size) {
+    size_t n = 0;
+    struct frame f;
+
+    for (unsigned w = 0; w < p.threads; w++) {
+        struct queue *q = queue_for(parity, w, s->id);
+        while (queue_pop(q, &f)) {
+            if (n == *size) {
+                *size = (*size ? *size * 2 : 256);
+                *batch = realloc(*batch, *size * sizeof(struct frame));
+            }
+            (*batch)[n++] = f;
+        }
+    }
+
+    qsort(*batch, n, sizeof(struct frame), frame_cmp);
+    for (size_t i = 0; i < n; i++)
+        enc_receive(s, &(*batch)[i]);
+}
+
+static void *worker(void *arg) {
+    unsigned w = (uintptr_t)arg;
+    struct frame *batch = NULL;
+    size_t size = 0;
+
+    for (uint64_t epoch = 0; epoch * p.epoch_us < end_us; epoch++) {
+        uint64_t epoch_end = (epoch + 1) * p.epoch_us;
+
+        for (unsigned i = w; i < p.segments; i += p.threads) {
+            struct segment *s = &segments[i];
+            if (epoch > 0)
+                deliver(s, (epoch - 1) & 1, &batch, &size);
+            s->parity = epoch & 1;
+            while (s->t < epoch_end && s->t < end_us)
+                pass(s, epoch_end);
+        }
+
+        barrier_wait();
+    }
+
+    free(batch);
+    return NULL;
+}
+
+/*
+ * ----------------------------------------------------------------------
+ * report
+ *
+ */
+
+static void add_stats(struct stats *sum, const struct stats *st) {
+    sum->passes += st->passes;
+    sum->pings += st->pings;
+    sum->messages += st->messages;
+    sum->node_drops += st->node_drops;
+    sum->message_latency_sum += st->message_latency_sum;
+    if (st->message_latency_max > sum->message_latency_max)
+        sum->message_latency_max = st->message_latency_max;
+    sum->multicasts += st->multicasts;
+    sum->enc_frames += st->enc_frames;
+    sum->enc_drops += st->enc_drops;
+    sum->enc_filtered += st->enc_filtered;
+    if (st->enc_max > sum->enc_max)
+        sum->enc_max = st->enc_max;
+    sum->commands += st->commands;
+    sum->foreign_commands += st->foreign_commands;
+    sum->group_frames += st->group_frames;
+    sum->command_latency_sum += st->command_latency_sum;
+    if (st->command_latency_max > sum->command_latency_max)
+        sum->command_latency_max = st->command_latency_max;
+    sum->bus_busy += st->bus_busy;
+    sum->queue_full += st->queue_full;
+}
+
+static double mean_ms(uint64_t sum, unsigned long n) {
+    return n ? sum / 1000.0 / n : 0.0;
+}
+
+static void print_stats(const char *name, const struct stats *st, unsigned segments) {
+    unsigned long offered = st->enc_frames + st->enc_drops;
+
+    printf("%s\n", name);
+    printf("  main loop wakeups      %lu\n", st->passes);
+    printf("  pings                  %lu\n", st->pings);
+    printf("  messages forwarded     %lu (%lu lost, node queue full)\n", st->messages, st->node_drops);
+    printf("  message latency        mean %.1f ms, max %.1f ms\n",
+           mean_ms(st->message_latency_sum, st->messages), st->message_latency_max / 1000.0);
+    printf("  multicasts sent        %lu\n", st->multicasts);
+    printf("  ENC28J60 frames        %lu read, %lu dropped (%.1f %%), at most %lu queued, %lu filtered\n",
+           st->enc_frames, st->enc_drops, offered ? 100.0 * st->enc_drops / offered : 0.0, st->enc_max,
+           st->enc_filtered);
+    printf("  commands               %lu delivered, %lu forwarded to the wrong bus\n",
+           st->commands, st->foreign_commands);
+    printf("  group frames           %lu from other segments put on the bus\n", st->group_frames);
+    printf("  command latency        mean %.1f ms, max %.1f ms\n",
+           mean_ms(st->command_latency_sum, st->commands), st->command_latency_max / 1000.0);
+    printf("  bus utilisation        %.2f %%\n", 100.0 * st->bus_busy / segments / (double)end_us);
+    if (st->queue_full)
+        printf("  simulator queue full   %lu (use a shorter epoch)\n", st->queue_full);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-s segments] [-N nodes per segment] [-t seconds] [-j threads]\n"
+                    "          [-E epoch ms] [-r messages per node and hour] [-c command probability]\n"
+                    "          [-p ping interval in ms] [-g groups] [-f forwarded groups] [-b baud]\n"
+                    "          [-l payload length] [-S seed] [-v]\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+
+    p.threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((c = getopt(argc, argv, "s:N:t:j:E:r:c:p:g:f:b:l:S:v")) != -1) {
+        switch (c) {
+        case 's': p.segments = atoi(optarg); break;
+        case 'N': p.nodes = atoi(optarg); break;
+        case 't': p.seconds = atof(optarg); break;
+        case 'j': p.threads = atoi(optarg); break;
+        case 'E': p.epoch_us = atof(optarg) * 1000; break;
+        case 'r': p.rate = atof(optarg); break;
+        case 'c': p.commands = atof(optarg); break;
+        case 'p': p.poll = atoi(optarg); break;
+        case 'g': p.groups = atoi(optarg); break;
+        case 'f': p.forwarded = atoi(optarg); break;
+        case 'b': p.baud = atol(optarg); break;
+        case 'l': p.len = atoi(optarg); break;
+        case 'S': p.seed = atoi(optarg); break;
+        case 'v': p.verbose = true; break;
+        default: usage(argv[0]);
+        }
+    }
+
+    if (p.segments == 0 || p.nodes == 0 || p.nodes > MAX_NODES || p.epoch_us == 0 || p.poll == 0 ||
+        p.groups == 0 || p.groups > 51)
+        usage(argv[0]);
+    if (p.threads == 0)
+        p.threads = 1;
+    if (p.threads > p.segments)
+        p.threads = p.segments;
+
+    end_us = p.seconds * 1e6;
+
+    segments = calloc(p.segments, sizeof(struct segment));
+    for (unsigned parity = 0; parity < 2; parity++) {
+        queues[parity] = calloc((size_t)p.threads * p.segments, sizeof(struct queue));
+        if (!queues[parity]) {
+            perror("calloc");
+            return 1;
+        }
+    }
+    for (unsigned i = 0; i < p.segments; i++)
+        segment_init(&segments[i], i, i % p.threads);
+
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_t threads[p.threads];
+    for (unsigned w = 0; w < p.threads; w++)
+        pthread_create(&threads[w], NULL, worker, (void *)(uintptr_t)w);
+    for (unsigned w = 0; w < p.threads; w++)
+        pthread_join(threads[w], NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    double wall = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+
+    struct stats total = { 0 };
+    for (unsigned i = 0; i < p.segments; i++) {
+        add_stats(&total, &segments[i].st);
+        if (p.verbose) {
+            char name[32];
+            snprintf(name, sizeof(name), "segment %u", i);
+            print_stats(name, &segments[i].st, 1);
+        }
+    }
+
+    printf("%u segments with %u nodes, %.0f s simulated in %.2f s on %u threads (%.0fx real time)\n",
+           p.segments, p.nodes, p.seconds, wall, p.threads, p.seconds / wall);
+    print_stats("all segments", &total, p.segments);
+
+    return 0;
+}
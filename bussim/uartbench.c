@@ -0,0 +1,109 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * Pushes synthetic bus frames through the receive path of lib/uart.c on the
+ * host: every character goes through ISR(USART0_RX_vect), every complete
+ * frame is taken out of the ringbuffer like a main loop would do it.
+ *
+ * Meant to be run under perf or callgrind to see the per-byte cost of the
+ * ISR, e.g.:
+ *
+ * $ valgrind --tool=callgrind ./uartbench -n 100000
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <avr/io.h>
+#include <mockusart.h>
+
+#include "bus.h"
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-n frames] [-l payload length] [-o frames for other nodes per frame]\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long frames = 1000000, other = 0;
+    uint8_t len = 8;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:l:o:")) != -1) {
+        switch (c) {
+        case 'n':
+            frames = strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            len = atoi(optarg);
+            break;
+        case 'o':
+            other = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    /* the ringbuffer holds 32 bytes, a frame has to fit in completely */
+    if (len > 32 - sizeof(struct buspkt) - 1)
+        len = 32 - sizeof(struct buspkt) - 1;
+
+    uint8_t mine[32], theirs[32], payload[32];
+    for (c = 0; c < len; c++)
+        payload[c] = 'a' + c;
+    fmt_packet(mine, MYADDRESS, 0, payload, len);
+    fmt_packet(theirs, MYADDRESS + 1, 0, payload, len);
+    uint8_t size = sizeof(struct buspkt) + len;
+
+    net_init();
+
+    unsigned long received = 0, errors = 0, bytes = 0, isr_calls = 0;
+    double start = now();
+
+    for (unsigned long f = 0; f < frames; f++) {
+        for (unsigned long o = 0; o < other; o++)
+            for (c = 0; c < size; c++, bytes++)
+                isr_calls += mock_usart0_receive(theirs[c] | (c == 0 ? 0x100 : 0), 0);
+
+        for (c = 0; c < size; c++, bytes++)
+            isr_calls += mock_usart0_receive(mine[c] | (c == 0 ? 0x100 : 0), 0);
+
+        /* main loop */
+        uint8_t status;
+        while ((status = bus_status()) != BUS_STATUS_IDLE) {
+            if (status == BUS_STATUS_MESSAGE) {
+                struct buspkt *packet = current_packet();
+                if (packet->source == 0 && packet->length_lo == len)
+                    received++;
+                packet_done();
+            } else {
+                errors++;
+                skip_byte();
+            }
+        }
+    }
+
+    double elapsed = now() - start;
+
+    printf("frames sent to us        %lu\n", frames);
+    printf("frames received          %lu\n", received);
+    printf("header checksum errors   %lu\n", errors);
+    printf("bytes on the bus         %lu\n", bytes);
+    printf("RX interrupts            %lu\n", isr_calls);
+    printf("time                     %.3f s\n", elapsed);
+    printf("per RX interrupt         %.1f ns (including main loop)\n",
+           isr_calls ? elapsed * 1e9 / isr_calls : 0);
+
+    return (received == frames ? 0 : 1);
+}
@@ -39,6 +39,7 @@ void send_packet(struct buspkt *pkt);
 void net_init();
 
 uint8_t bus_status();
+uint8_t bus_sending();
 void skip_byte();
 void packet_done();
 
@@ -0,0 +1,98 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * On the AVR, the words are added in one chain of adc instructions: the
+ * carry of a word goes into the next one and only the carry out of the
+ * last word is folded back in. That is 9 cycles per word (two ld, two adc,
+ * dec and brne), where the C version compares and branches for the carry of
+ * every word. Compiled for the host (mock builds, chksumbench), the C
+ * version below sums the high and the low bytes separately into 32 bits
+ * and folds the carries in once at the end.
+ *
+ * The assembly loop has not been built with avr-gcc and run on the target
+ * yet, so the AVR uses the C version, too, unless CHKSUM_ASM is defined.
+ * chksumbench.hex checks and times it on the ATmega.
+ *
+ */
+#include <stdint.h>
+
+#include "chksum.h"
+
+#if defined(__AVR__) && defined(CHKSUM_ASM)
+
+uint16_t chksum(uint16_t sum, const uint8_t *data, uint16_t len) {
+    uint16_t words = len >> 1;
+    uint8_t count_lo = words;
+    uint8_t count_hi = words >> 8;
+    uint8_t high;
+
+    /* The counter runs in two bytes: count_lo words, then count_hi times
+     * 256 words. dec, inc, tst, or, ld and the branches leave the carry
+     * alone. */
+    __asm__ __volatile__ (
+        "clc"                           "\n\t"
+        "mov  __tmp_reg__, %[lo]"       "\n\t"
+        "or   __tmp_reg__, %[hi]"       "\n\t"
+        "breq 3f"                       "\n\t"
+        "tst  %[lo]"                    "\n\t"
+        "breq 1f"                       "\n\t"
+        "inc  %[hi]"                    "\n"
+        "1:"                            "\n\t"
+        "ld   %[high], %a[p]+"          "\n\t"
+        "ld   __tmp_reg__, %a[p]+"      "\n\t"
+        "adc  %A[sum], __tmp_reg__"     "\n\t"
+        "adc  %B[sum], %[high]"         "\n\t"
+        "dec  %[lo]"                    "\n\t"
+        "brne 1b"                       "\n\t"
+        "dec  %[hi]"                    "\n\t"
+        "brne 1b"                       "\n"
+        "3:"                            "\n\t"
+        /* odd length: the last byte is the high byte of a word */
+        "sbrs %[len], 0"                "\n\t"
+        "rjmp 4f"                       "\n\t"
+        "ld   %[high], %a[p]"           "\n\t"
+        "adc  %A[sum], __zero_reg__"    "\n\t"
+        "adc  %B[sum], %[high]"         "\n"
+        "4:"                            "\n\t"
+        /* end-around carry; a carry out of the high byte leaves the low
+         * byte at 0, so the third adc can not overflow */
+        "adc  %A[sum], __zero_reg__"    "\n\t"
+        "adc  %B[sum], __zero_reg__"    "\n\t"
+        "adc  %A[sum], __zero_reg__"    "\n\t"
+        : [sum] "+r" (sum), [p] "+e" (data), [lo] "+r" (count_lo),
+          [hi] "+r" (count_hi), [high] "=&r" (high)
+        : [len] "r" ((uint8_t)len)
+        : "memory"
+    );
+
+    return sum;
+}
+
+#else
+
+uint16_t chksum(uint16_t sum, const uint8_t *data, uint16_t len) {
+    uint32_t acc = sum;
+
+    /* high and low bytes are summed separately, 4 bytes per round */
+    uint32_t high = 0, low = 0;
+    for (; len >= 4; len -= 4, data += 4) {
+        high += data[0] + data[2];
+        low += data[1] + data[3];
+    }
+    acc += (high << 8) + low;
+
+    if (len >= 2) {
+        acc += (data[0] << 8) | data[1];
+        data += 2;
+        len -= 2;
+    }
+    if (len > 0)
+        acc += data[0] << 8;
+
+    while (acc >> 16)
+        acc = (acc & 0xffff) + (acc >> 16);
+
+    return acc;
+}
+
+#endif
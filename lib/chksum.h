@@ -0,0 +1,32 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * Internet checksum (RFC 1071) for the IPv6 code of the busmasters.
+ *
+ */
+#ifndef _CHKSUM_H
+#define _CHKSUM_H
+
+#include <stdint.h>
+
+/*
+ * Adds the 'len' bytes at 'data' as big endian 16 bit words (the last one
+ * padded with a zero byte) to the one's complement sum 'sum' and returns
+ * the new sum, not complemented. Several calls can be chained.
+ *
+ */
+uint16_t chksum(uint16_t sum, const uint8_t *data, uint16_t len);
+
+/* adds the 16 bit word 'value' to the one's complement sum 'sum' */
+static inline uint16_t chksum_add(uint16_t sum, uint16_t value) {
+    sum += value;
+    return sum + (sum < value);
+}
+
+/* The checksum after a 16 bit word of the data changed from 'old' to
+ * 'new', RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m') */
+static inline uint16_t chksum_update(uint16_t checksum, uint16_t old, uint16_t new) {
+    return ~chksum_add(chksum_add(~checksum, ~old), new);
+}
+
+#endif
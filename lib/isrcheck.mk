@@ -0,0 +1,33 @@
+# vim:ts=4:sw=4:noexpandtab
+#
+# The isrcheck target, included by the firmware Makefiles below all:
+#
+#   make isrcheck
+#
+# Estimates the worst-case cycles of every ISR from the disassembly and fails
+# if one takes longer than half a character on the bus, or if it contains
+# something the estimate cannot count (icall, ijmp, a jump to an unknown
+# address). Not part of all: tools/isrbudget.pl has not been checked against
+# the avr-objdump output of a real firmware, a passing isrcheck proves
+# nothing yet. Whoever builds with avr-gcc first should compare its numbers
+# with a simulator or a scope on an ISR pin and then add isrcheck to all.
+#
+# All loops are assumed to run UARTBUF times. Loops with another bound are
+# set per function in ISRCHECK_FLAGS, e.g.
+#
+#   make isrcheck ISRCHECK_FLAGS=--loop-bound=<function>=8
+#
+# Bus speed and loop bound come from the UART driver the firmware is built
+# with (BAUD and the ringbuffer size UARTBUF), so there is nothing to keep
+# in sync here. Set UART_SOURCE before the include if it is not lib/uart.c.
+
+UART_SOURCE ?= ../lib/uart.c
+
+BAUD := $(shell sed -n 's/^\#define BAUD \([0-9]*\).*/\1/p' $(UART_SOURCE))
+UARTBUF := $(shell sed -n 's/^\#define UARTBUF \([0-9]*\).*/\1/p' $(UART_SOURCE))
+ISRCHECK_FLAGS ?=
+
+.PHONY: isrcheck
+
+isrcheck: firmware.hex
+	avr-objdump -d $(shell basename $< .hex).bin | perl ../tools/isrbudget.pl --mcu=${MCU} --f-cpu=${MHZ} --baud=${BAUD} --loop-bound=${UARTBUF} $(ISRCHECK_FLAGS)
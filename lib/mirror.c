@@ -0,0 +1,118 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * Bus mirror: every byte the busmaster receives on the bus, with its
+ * address bit, the receive errors and a timestamp, published as binary UDP
+ * datagrams on ff05::b5:fc. Frames with a broken header are in there, too,
+ * byte by byte as they came in. application/mirror2pcap.pl writes the
+ * stream to a capture file.
+ *
+ * Only built with -DBUS_MIRROR (see busmaster/Makefile), the busmaster
+ * switches it off and on with the "mirror" command.
+ *
+ * All values are big endian:
+ *
+ *   header   0     version (1)
+ *            1     number of records
+ *            2-3   sequence number of the datagram
+ *            4-5   bytes lost because the ring was full (wraps around)
+ *            6-7   millisecond of the first record (wraps around)
+ *            8-9   timer ticks per millisecond
+ *
+ *   record   0     the byte
+ *            1     flags, see mirror.h
+ *            2-3   time since the start of the millisecond in the header,
+ *                  in timer ticks
+ *
+ * A datagram spans less than 0xffff ticks, so that the times fit.
+ *
+ */
+#ifdef BUS_MIRROR
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "mirror.h"
+
+#define MIRROR_VERSION 1
+#define RECORDS ((MIRROR_REPORT_MAX - 10) / 4)
+
+#ifndef MIRROR_ENABLED
+#define MIRROR_ENABLED 1
+#endif
+
+volatile uint8_t mirror_enabled = MIRROR_ENABLED;
+struct mirror_entry mirror_ring[MIRROR_RING];
+volatile uint8_t mirror_write;
+volatile uint8_t mirror_read;
+volatile uint16_t mirror_lost;
+
+static uint8_t records[RECORDS][4];
+static uint8_t count;
+static uint16_t first_ms;
+/* the next byte is too late for this datagram */
+static bool closed;
+static uint16_t sequence;
+
+void mirror_collect(void) {
+    uint16_t per_ms = OCR1A + 1;
+
+    while (mirror_read != mirror_write && count < RECORDS && !closed) {
+        struct mirror_entry *e = &mirror_ring[mirror_read];
+
+        if (count == 0)
+            first_ms = e->ms;
+        uint16_t since = e->ms - first_ms;
+        if (since >= 0xffff / per_ms) {
+            closed = true;
+            break;
+        }
+
+        uint16_t ticks = since * per_ms + e->ticks;
+        uint8_t *record = records[count++];
+        record[0] = e->data;
+        record[1] = e->flags;
+        record[2] = ticks >> 8;
+        record[3] = ticks;
+
+        mirror_read = (mirror_read + 1) & (MIRROR_RING - 1);
+    }
+}
+
+uint8_t mirror_report(uint8_t *buf, uint16_t now) {
+    mirror_collect();
+
+    if (count == 0)
+        return 0;
+    if (count < RECORDS && !closed && (int16_t)(now - first_ms) < MIRROR_INTERVAL_MS)
+        return 0;
+
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t lost = mirror_lost;
+    SREG = sreg;
+
+    uint16_t per_ms = OCR1A + 1;
+    buf[0] = MIRROR_VERSION;
+    buf[1] = count;
+    buf[2] = sequence >> 8;
+    buf[3] = sequence;
+    buf[4] = lost >> 8;
+    buf[5] = lost;
+    buf[6] = first_ms >> 8;
+    buf[7] = first_ms;
+    buf[8] = per_ms >> 8;
+    buf[9] = per_ms;
+    memcpy(buf + 10, records, count * 4);
+
+    uint8_t len = 10 + count * 4;
+    sequence++;
+    count = 0;
+    closed = false;
+    return len;
+}
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ */
+#ifndef _MIRROR_H
+#define _MIRROR_H
+
+#include <stdint.h>
+#include <avr/io.h>
+
+/* multicast group (ff05::b5:fc) the bytes are published on */
+#define MIRROR_GROUP 0xfc
+
+/* flags of a byte, the error bits are the ones of UCSR0A */
+#define MIRROR_ADDRESS      0x01
+#define MIRROR_PARITY_ERROR (1 << UPE0)
+#define MIRROR_OVERRUN      (1 << DOR0)
+#define MIRROR_FRAME_ERROR  (1 << FE0)
+#define MIRROR_ERRORS       (MIRROR_PARITY_ERROR | MIRROR_OVERRUN | MIRROR_FRAME_ERROR)
+
+/* bytes between the RX interrupt and the main loop, a power of two */
+#ifndef MIRROR_RING
+#define MIRROR_RING 32
+#endif
+
+/* a datagram goes out at the latest this long after its first byte */
+#ifndef MIRROR_INTERVAL_MS
+#define MIRROR_INTERVAL_MS 20
+#endif
+
+/* longest datagram mirror_report() returns, fits UIP_BUFSIZE */
+#define MIRROR_REPORT_MAX (10 + 32 * 4)
+
+struct mirror_entry {
+    uint8_t data;
+    uint8_t flags;
+    uint16_t ms;
+    uint16_t ticks;
+};
+
+/* the millisecond counter of timer 1 (busmaster/main.c) */
+extern volatile uint16_t timer_ms;
+
+extern volatile uint8_t mirror_enabled;
+extern struct mirror_entry mirror_ring[MIRROR_RING];
+extern volatile uint8_t mirror_write;
+extern volatile uint8_t mirror_read;
+extern volatile uint16_t mirror_lost;
+
+/* Records a received byte with the time, called by the RX interrupt of
+ * lib/uart.c. Kept inline, so that it does not add the register saves of
+ * a call to the handler. */
+static inline void mirror_byte(uint8_t data, uint8_t flags) {
+    if (!mirror_enabled)
+        return;
+
+    uint8_t next = (mirror_write + 1) & (MIRROR_RING - 1);
+    if (next == mirror_read) {
+        mirror_lost++;
+        return;
+    }
+
+    uint16_t ticks = TCNT1;
+    uint16_t ms = timer_ms;
+    /* the compare match which reset TCNT1 may be pending while interrupts
+     * are disabled, then timer_ms is one behind */
+    if ((TIFR1 & (1 << OCF1A)) && ticks < OCR1A / 2)
+        ms++;
+
+    struct mirror_entry *e = &mirror_ring[mirror_write];
+    e->data = data;
+    e->flags = flags;
+    e->ms = ms;
+    e->ticks = ticks;
+    mirror_write = next;
+}
+
+/* Moves the recorded bytes into the next datagram, as far as they fit.
+ * Call it often, the ring only holds MIRROR_RING bytes. */
+void mirror_collect(void);
+
+/* Fills 'buf' with the next datagram when it is due: its first byte waited
+ * MIRROR_INTERVAL_MS or it is full. Returns its length, 0 if there is
+ * nothing to send. */
+uint8_t mirror_report(uint8_t *buf, uint16_t now);
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * Events of the busmaster (pings, pongs, sendreqs, ...) as numeric codes,
+ * collected in SRAM and published as one binary UDP datagram on
+ * ff05::b5:fd per TELEMETRY_INTERVAL_MS, instead of one text frame each.
+ *
+ * All values are big endian:
+ *
+ *   header   0     version (1)
+ *            1     telemetry_level
+ *            2-3   events lost because the buffer was full
+ *            4     number of records
+ *            5     reserved (0)
+ *
+ *   record   0     event code, see telemetry.h
+ *            1-2   arguments
+ *            3-4   time of the event in ms (wraps around)
+ *
+ * The level can be changed at runtime (see busmaster/main.c), events above
+ * TELEMETRY_MAX_LEVEL are compiled out.
+ *
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "telemetry.h"
+
+#define TELEMETRY_VERSION 1
+#define RECORDS ((TELEMETRY_REPORT_MAX - 6) / 5)
+
+uint8_t telemetry_level = TELEMETRY_LEVEL;
+
+static uint8_t records[RECORDS][5];
+static uint8_t count;
+static uint16_t first_at;
+static uint16_t lost;
+
+void telemetry_event(uint8_t code, uint8_t arg1, uint8_t arg2, uint16_t now) {
+    if (count == RECORDS) {
+        lost++;
+        return;
+    }
+
+    if (count == 0)
+        first_at = now;
+
+    uint8_t *record = records[count++];
+    record[0] = code;
+    record[1] = arg1;
+    record[2] = arg2;
+    record[3] = now >> 8;
+    record[4] = now;
+}
+
+uint8_t telemetry_report(uint8_t *buf, uint16_t now) {
+    if (count == 0)
+        return 0;
+    if (count < RECORDS && (int16_t)(now - first_at) < TELEMETRY_INTERVAL_MS)
+        return 0;
+
+    buf[0] = TELEMETRY_VERSION;
+    buf[1] = telemetry_level;
+    buf[2] = lost >> 8;
+    buf[3] = lost;
+    buf[4] = count;
+    buf[5] = 0;
+    memcpy(buf + 6, records, count * 5);
+
+    uint8_t len = 6 + count * 5;
+    count = 0;
+    lost = 0;
+    return len;
+}
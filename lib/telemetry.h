@@ -0,0 +1,64 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ */
+#ifndef _TELEMETRY_H
+#define _TELEMETRY_H
+
+#include <stdint.h>
+
+/* multicast group (ff05::b5:fd) the events are published on */
+#define TELEMETRY_GROUP 0xfd
+
+/* levels, an event is recorded if its level is <= telemetry_level */
+#define TELEMETRY_OFF   0
+#define TELEMETRY_ERROR 1
+#define TELEMETRY_INFO  2
+#define TELEMETRY_DEBUG 3
+
+/* level after a reset */
+#ifndef TELEMETRY_LEVEL
+#define TELEMETRY_LEVEL TELEMETRY_INFO
+#endif
+
+/* events above this level are not even compiled in */
+#ifndef TELEMETRY_MAX_LEVEL
+#define TELEMETRY_MAX_LEVEL TELEMETRY_DEBUG
+#endif
+
+/* a datagram goes out at the latest this long after its first event */
+#ifndef TELEMETRY_INTERVAL_MS
+#define TELEMETRY_INTERVAL_MS 1000
+#endif
+
+/* event codes, the arguments are in parentheses */
+enum telemetry_code {
+    TELEMETRY_BOOT = 1,         /* (ENC28J60 revision) */
+    TELEMETRY_PING_SENT,        /* (node) */
+    TELEMETRY_PONG_RECEIVED,    /* (node, waiting frames) */
+    TELEMETRY_SENDREQ_SENT,     /* (node, further sendreqs) */
+    TELEMETRY_COMMAND_SENT,     /* (node, length) */
+    TELEMETRY_BROKEN_HEADER,    /* (destination, source) of the header */
+    TELEMETRY_SERIAL_STATUS,    /* (bytes buffered, bytes remaining) */
+    TELEMETRY_LEVEL_CHANGED,    /* (new level) */
+};
+
+/* longest datagram telemetry_report() returns */
+#define TELEMETRY_REPORT_MAX (6 + 26 * 5)
+
+extern uint8_t telemetry_level;
+
+void telemetry_event(uint8_t code, uint8_t arg1, uint8_t arg2, uint16_t now);
+
+/* Records an event if 'level' is enabled. Below the level, this costs a
+ * compare: the arguments (and 'now') are not evaluated. */
+#define TELEMETRY(level, code, arg1, arg2, now) do {                    \
+        if ((level) <= TELEMETRY_MAX_LEVEL && (level) <= telemetry_level) \
+            telemetry_event((code), (arg1), (arg2), (now));             \
+    } while (0)
+
+/* Fills 'buf' with the recorded events when a datagram is due: the first
+ * one waited TELEMETRY_INTERVAL_MS or the buffer is full. Returns its
+ * length, 0 if there is nothing to send. */
+uint8_t telemetry_report(uint8_t *buf, uint16_t now);
+
+#endif
@@ -10,6 +10,9 @@
 #include <stdio.h>
 
 #include "bus.h"
+#ifdef BUS_MIRROR
+#include "mirror.h"
+#endif
 
 #ifdef BUSMASTER
     /* etherrape board */
@@ -147,6 +150,11 @@ ISR(USART1_RX_vect) {
     usr = UCSR0A;
     data = UDR0;
 
+#ifdef BUS_MIRROR
+    /* every byte, also the ones with errors and of broken frames */
+    mirror_byte(data, (usr & MIRROR_ERRORS) | (is_addr ? MIRROR_ADDRESS : 0));
+#endif
+
     if (is_addr && data == MYADDRESS) {
         UCSR0A &= ~(1 << MPCM0);
     }
@@ -248,6 +256,15 @@ ISR(USART1_TX_vect) {
     }
 }
 
+/*
+ * Returns whether send_packet() is still transmitting (the packet must not
+ * be changed until it is done).
+ *
+ */
+uint8_t bus_sending() {
+    return (UCSR0B & (1 << TXCIE0)) != 0;
+}
+
 void send_packet(struct buspkt *pkt) {
     /* initialize pointer / length counter */
     txwalk = (uint8_t*)pkt;
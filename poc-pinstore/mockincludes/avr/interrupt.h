@@ -0,0 +1,10 @@
+#ifndef _AVR_INTERRUPT_H
+#define _AVR_INTERRUPT_H
+
+/* On the host, an ISR is an ordinary function which the simulation calls. */
+#define ISR(vector) void vector(void)
+
+#define sei() (void)(0)
+#define cli() (void)(0)
+
+#endif
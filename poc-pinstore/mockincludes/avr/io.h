@@ -0,0 +1,165 @@
+#ifndef _AVR_IO_H
+#define _AVR_IO_H
+
+#include <stdint.h>
+
+/*
+ * Host stand-in for the I/O registers. Every register is a plain variable
+ * (defined in ../mockio.c), so firmware code can be compiled and run
+ * unchanged on the build host.
+ *
+ */
+
+#define _BV(bit) (1 << (bit))
+
+/* the mocked device is an ATmega644(P), lib/uart.c uses USART0 for it */
+#ifndef __AVR_ATmega644__
+#define __AVR_ATmega644__ 1
+#endif
+
+extern volatile uint8_t SREG;
+
+/* ports */
+extern volatile uint8_t DDRB, PORTB, PINB;
+extern volatile uint8_t DDRC, PORTC, PINC;
+extern volatile uint8_t DDRD, PORTD, PIND;
+
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+
+#define PC0 0
+#define PC1 1
+#define PC2 2
+#define PC3 3
+#define PC4 4
+#define PC5 5
+#define PC6 6
+#define PC7 7
+
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+
+/* external interrupts (the ENC28J60 INT line is on INT2) */
+extern volatile uint8_t EICRA, EIMSK, EIFR;
+
+#define ISC00 0
+#define ISC01 1
+#define ISC10 2
+#define ISC11 3
+#define ISC20 4
+#define ISC21 5
+
+#define INT0  0
+#define INT1  1
+#define INT2  2
+
+#define INTF0 0
+#define INTF1 1
+#define INTF2 2
+
+/* timer 1 */
+extern volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+extern volatile uint16_t OCR1A, TCNT1;
+
+#define WGM10  0
+#define WGM11  1
+#define CS10   0
+#define CS11   1
+#define CS12   2
+#define WGM12  3
+#define WGM13  4
+#define TOIE1  0
+#define OCIE1A 1
+#define OCIE1B 2
+
+#define TOV1   0
+#define OCF1A  1
+#define OCF1B  2
+
+/* SPI */
+extern volatile uint8_t SPCR, SPSR, SPDR;
+
+#define SPR0  0
+#define SPR1  1
+#define CPHA  2
+#define CPOL  3
+#define MSTR  4
+#define DORD  5
+#define SPE   6
+#define SPIE  7
+
+#define SPI2X 0
+#define WCOL  6
+#define SPIF  7
+
+/* USART0 (RS485 bus) and USART1 (debug output, lib/uart2.c) */
+extern volatile uint8_t UCSR0A, UCSR0B, UCSR0C, UDR0, UBRR0H, UBRR0L;
+extern volatile uint8_t UCSR1A, UCSR1B, UCSR1C, UDR1, UBRR1H, UBRR1L;
+
+#define MPCM0   0
+#define U2X0    1
+#define UPE0    2
+#define DOR0    3
+#define FE0     4
+#define UDRE0   5
+#define TXC0    6
+#define RXC0    7
+
+#define TXB80   0
+#define RXB80   1
+#define UCSZ02  2
+#define TXEN0   3
+#define RXEN0   4
+#define UDRIE0  5
+#define TXCIE0  6
+#define RXCIE0  7
+
+#define UCPOL0  0
+#define UCSZ00  1
+#define UCSZ01  2
+#define USBS0   3
+#define UPM00   4
+#define UPM01   5
+#define UMSEL00 6
+#define UMSEL01 7
+
+#define MPCM1   0
+#define U2X1    1
+#define UPE1    2
+#define DOR1    3
+#define FE1     4
+#define UDRE1   5
+#define TXC1    6
+#define RXC1    7
+
+#define TXB81   0
+#define RXB81   1
+#define UCSZ12  2
+#define TXEN1   3
+#define RXEN1   4
+#define UDRIE1  5
+#define TXCIE1  6
+#define RXCIE1  7
+
+#define UCPOL1  0
+#define UCSZ10  1
+#define UCSZ11  2
+#define USBS1   3
+#define UPM10   4
+#define UPM11   5
+#define UMSEL10 6
+#define UMSEL11 7
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef _AVR_PGMSPACE_H
+#define _AVR_PGMSPACE_H
+
+#include <string.h>
+#include <stdio.h>
+
+/* The host has a single address space, flash is just memory. */
+#define PROGMEM
+#define PSTR(s) (s)
+
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define memcpy_P memcpy
+#define memcmp_P memcmp
+#define strlen_P strlen
+#define vsnprintf_P vsnprintf
+
+#endif
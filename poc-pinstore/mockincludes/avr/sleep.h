@@ -0,0 +1,15 @@
+#ifndef _AVR_SLEEP_H
+#define _AVR_SLEEP_H
+
+/* The host does not sleep: sleep_cpu() lets a simulation advance the virtual
+ * clock to the next interrupt (see ../mockio.c). */
+#define SLEEP_MODE_IDLE 0
+
+#define set_sleep_mode(mode) (void)(mode)
+#define sleep_enable() (void)(0)
+#define sleep_disable() (void)(0)
+
+void mock_sleep(void);
+#define sleep_cpu() mock_sleep()
+
+#endif
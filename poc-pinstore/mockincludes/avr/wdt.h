@@ -0,0 +1,14 @@
+#ifndef _AVR_WDT_H
+#define _AVR_WDT_H
+
+#define WDTO_15MS 0
+
+/* Enabling the watchdog is how the firmware resets itself, the mock calls
+ * mock_wdt_hook (see ../mockio.c) instead. */
+void mock_wdt_enable(unsigned char timeout);
+
+#define wdt_enable(timeout) mock_wdt_enable(timeout)
+#define wdt_disable() (void)(0)
+#define wdt_reset() (void)(0)
+
+#endif
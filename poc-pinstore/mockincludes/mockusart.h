@@ -0,0 +1,70 @@
+#ifndef _MOCKUSART_H
+#define _MOCKUSART_H
+
+#include <stdint.h>
+#include <avr/io.h>
+
+/*
+ * Drives USART0 of the mock register file from the host side: the helpers
+ * do what the hardware does around a received or transmitted character and
+ * call the interrupt handlers (ISR(USART0_RX_vect) and ISR(USART0_TX_vect)
+ * in lib/uart.c) directly.
+ *
+ * A character is 9 bit wide, bit 8 is the address bit (RXB80 / TXB80).
+ *
+ */
+
+void USART0_RX_vect(void);
+void USART0_TX_vect(void);
+
+/*
+ * Receives one character with the given error flags (any of _BV(FE0),
+ * _BV(DOR0), _BV(UPE0)). Returns 0 if the character was discarded by the
+ * hardware (receiver or interrupt disabled, or a data character while in
+ * multi-processor communication mode), 1 if the RX interrupt ran.
+ *
+ */
+static inline uint8_t mock_usart0_receive(uint16_t c, uint8_t errors) {
+    if (!(UCSR0B & _BV(RXEN0)) || !(UCSR0B & _BV(RXCIE0)))
+        return 0;
+
+    if ((UCSR0A & _BV(MPCM0)) && !(c & 0x100))
+        return 0;
+
+    if (c & 0x100)
+        UCSR0B |= _BV(RXB80);
+    else UCSR0B &= ~_BV(RXB80);
+
+    UCSR0A = (UCSR0A & ~(_BV(FE0) | _BV(DOR0) | _BV(UPE0))) | errors | _BV(RXC0);
+    UDR0 = (uint8_t)c;
+
+    USART0_RX_vect();
+
+    UCSR0A &= ~_BV(RXC0);
+    return 1;
+}
+
+/*
+ * Returns whether a transmission is in progress (send_packet() was called
+ * and the last TX complete interrupt has not run yet).
+ *
+ */
+static inline uint8_t mock_usart0_sending(void) {
+    return (UCSR0B & _BV(TXCIE0)) != 0;
+}
+
+/*
+ * Finishes shifting out the character in UDR0: returns it and runs the TX
+ * complete interrupt, which loads the next one.
+ *
+ */
+static inline uint16_t mock_usart0_transmit(void) {
+    uint16_t c = UDR0 | ((UCSR0B & _BV(TXB80)) ? 0x100 : 0);
+
+    if (UCSR0B & _BV(TXCIE0))
+        USART0_TX_vect();
+
+    return c;
+}
+
+#endif
@@ -1,4 +1,17 @@
 #ifndef _UTIL_DELAY_H
 #define _UTIL_DELAY_H
-#define _delay_ms(x) (void)(1)
+
+#include <stdint.h>
+
+#ifndef F_CPU
+#define F_CPU 1000000UL
+#endif
+
+/* Delays do not sleep, they advance the virtual clock (see ../mockio.c). */
+void mock_delay_cycles(uint32_t cycles);
+
+#define _delay_ms(ms) mock_delay_cycles((uint32_t)((double)(ms) * (F_CPU / 1000.0)))
+#define _delay_us(us) mock_delay_cycles((uint32_t)((double)(us) * (F_CPU / 1000000.0)))
+#define _delay_loop_2(count) mock_delay_cycles((uint32_t)(count) * 4)
+
 #endif
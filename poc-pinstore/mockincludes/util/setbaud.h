@@ -0,0 +1,17 @@
+#ifndef _UTIL_SETBAUD_H
+#define _UTIL_SETBAUD_H
+
+#ifndef F_CPU
+#error "util/setbaud.h requires F_CPU to be defined"
+#endif
+#ifndef BAUD
+#error "util/setbaud.h requires BAUD to be defined"
+#endif
+
+/* same rounding as avr-libc, without the U2X fallback */
+#define UBRR_VALUE (((F_CPU) + 8UL * (BAUD)) / (16UL * (BAUD)) - 1UL)
+#define UBRRL_VALUE (UBRR_VALUE & 0xff)
+#define UBRRH_VALUE (UBRR_VALUE >> 8)
+#define USE_2X 0
+
+#endif
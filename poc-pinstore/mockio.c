@@ -0,0 +1,68 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * Register file and virtual clock for host (mock) builds, see
+ * mockincludes/avr/io.h and mockincludes/util/delay.h.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <avr/io.h>
+
+volatile uint8_t SREG;
+
+volatile uint8_t DDRB, PORTB, PINB;
+volatile uint8_t DDRC, PORTC, PINC;
+volatile uint8_t DDRD, PORTD, PIND;
+
+volatile uint8_t EICRA, EIMSK, EIFR;
+
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+volatile uint16_t OCR1A, TCNT1;
+
+volatile uint8_t SPCR, SPSR, SPDR;
+
+/* the transmit buffers are always empty, the host sends instantly */
+volatile uint8_t UCSR0A = _BV(UDRE0), UCSR0B, UCSR0C = _BV(UCSZ01) | _BV(UCSZ00), UDR0, UBRR0H, UBRR0L;
+volatile uint8_t UCSR1A = _BV(UDRE1), UCSR1B, UCSR1C = _BV(UCSZ11) | _BV(UCSZ10), UDR1, UBRR1H, UBRR1L;
+
+/* virtual time in CPU cycles since reset */
+uint64_t mock_cycles = 0;
+
+/* called on every delay, a simulation uses this to let time pass */
+void (*mock_delay_hook)(void) = NULL;
+
+/* length of the last delay, lets a simulation tell the delays apart */
+uint32_t mock_delay_last;
+
+void mock_delay_cycles(uint32_t cycles) {
+    mock_cycles += cycles;
+    mock_delay_last = cycles;
+    if (mock_delay_hook != NULL)
+        mock_delay_hook();
+}
+
+/* called by sleep_cpu(), a simulation lets time pass until the next
+ * interrupt from here */
+void (*mock_sleep_hook)(void) = NULL;
+
+void mock_sleep(void) {
+    if (mock_sleep_hook != NULL)
+        mock_sleep_hook();
+}
+
+/* called instead of resetting the MCU by watchdog; a simulation can longjmp()
+ * back to its own reset handling from here */
+void (*mock_wdt_hook)(void) = NULL;
+
+void mock_wdt_enable(unsigned char timeout) {
+    (void)timeout;
+    if (mock_wdt_hook != NULL)
+        mock_wdt_hook();
+
+    fprintf(stderr, "mock: watchdog reset\n");
+    abort();
+}
@@ -0,0 +1,343 @@
+#!/usr/bin/env perl
+# vim:ts=4:sw=4:expandtab
+#
+# Estimates the worst-case number of CPU cycles of every interrupt handler in
+# a firmware from its disassembly and fails if one of them exceeds the time
+# budget for one character on the bus.
+#
+# Usage (see the isrcheck target in lib/isrcheck.mk, "make isrcheck"):
+#
+#   avr-objdump -d firmware.bin | \
+#       perl ../tools/isrbudget.pl --mcu=atmega644 --f-cpu=20000000 --baud=38400
+#
+# The estimate is static: the longest path through each handler, including
+# everything it calls, with every loop assumed to run --loop-bound times (the
+# ringbuffer size UARTBUF in lib/uart.c, the longest loop inside the RX
+# handler). --loop-bound=function=N sets the bound for the loops of one
+# function and may be given more than once. Paths which never return (the
+# watchdog reset on ringbuffer overflow) are not counted.
+#
+# What the disassembly does not tell cannot be counted: indirect calls and
+# jumps (icall, ijmp), jumps to addresses outside any known function and
+# recursion. A handler containing one of those is reported as INCOMPLETE
+# with the number of cycles as a lower bound, and fails the check unless
+# --allow-incomplete is given.
+#
+# Not yet checked against the avr-objdump output of a real firmware, see
+# lib/isrcheck.mk.
+#
+# A character takes 11 bit times on the bus (start bit, 9 data bits, stop
+# bit). No handler may run for longer than --budget percent of that, because
+# while it runs, the RX interrupt is blocked.
+
+use strict;
+use warnings;
+use Getopt::Long;
+use v5.10;
+
+my $mcu = 'atmega644';
+my $f_cpu = 20_000_000;
+my $baud = 38400;
+my $loop_bound = 32;
+my $budget = 50;
+my %loop_bounds;
+my $allow_incomplete = 0;
+my $verbose = 0;
+
+my $usage = "usage: $0 [--mcu=M] [--f-cpu=HZ] [--baud=B] [--loop-bound=[function=]N]... "
+    . "[--budget=PERCENT] [--allow-incomplete] [--verbose] [disassembly]\n";
+
+GetOptions(
+    'mcu=s' => \$mcu,
+    'f-cpu=s' => \$f_cpu,
+    'baud=i' => \$baud,
+    'loop-bound=s' => sub {
+        my ($option, $value) = @_;
+        if ($value =~ /^\d+$/) {
+            $loop_bound = $value;
+        } elsif ($value =~ /^([\w.]+)=(\d+)$/) {
+            $loop_bounds{$1} = $2;
+        } else {
+            die "invalid --loop-bound '$value'\n";
+        }
+    },
+    'budget=i' => \$budget,
+    'allow-incomplete' => \$allow_incomplete,
+    'verbose' => \$verbose,
+) or die $usage;
+
+$f_cpu =~ s/UL?$//i;
+
+# interrupt vector numbers, as in the __vector_N symbols avr-gcc emits
+my %vectors = (
+    atmega644 => [qw(RESET INT0 INT1 INT2 PCINT0 PCINT1 PCINT2 PCINT3 WDT
+                     TIMER2_COMPA TIMER2_COMPB TIMER2_OVF TIMER1_CAPT
+                     TIMER1_COMPA TIMER1_COMPB TIMER1_OVF TIMER0_COMPA
+                     TIMER0_COMPB TIMER0_OVF SPI_STC USART0_RX USART0_UDRE
+                     USART0_TX ANALOG_COMP ADC EE_READY TWI SPM_READY
+                     USART1_RX USART1_UDRE USART1_TX)],
+    atmega128 => [qw(RESET INT0 INT1 INT2 INT3 INT4 INT5 INT6 INT7
+                     TIMER2_COMP TIMER2_OVF TIMER1_CAPT TIMER1_COMPA
+                     TIMER1_COMPB TIMER1_OVF TIMER0_COMP TIMER0_OVF SPI_STC
+                     USART0_RX USART0_UDRE USART0_TX ADC EE_READY
+                     ANALOG_COMP TIMER1_COMPC TIMER3_CAPT TIMER3_COMPA
+                     TIMER3_COMPB TIMER3_COMPC TIMER3_OVF USART1_RX
+                     USART1_UDRE USART1_TX TWI SPM_READY)],
+);
+$vectors{atmega644p} = $vectors{atmega644};
+
+# cycles on a device with a 16 bit program counter, [not taken, taken]
+my %cycles = (
+    (map { $_ => 1 } qw(add adc sub subi sbc sbci and andi or ori eor com neg
+                        inc dec tst clr ser cp cpc cpi mov movw ldi in out lsl
+                        lsr rol ror asr swap bset bclr bst bld sec clc sen cln
+                        sez clz sei cli ses cls sev clv set clt seh clh nop
+                        sleep wdr sbr cbr)),
+    (map { $_ => 2 } qw(adiw sbiw mul muls mulsu fmul fmuls fmulsu ld ldd st
+                        std lds sts push pop sbi cbi rjmp ijmp)),
+    (map { $_ => 3 } qw(lpm elpm jmp rcall icall)),
+    (map { $_ => 4 } qw(call ret reti)),
+);
+my %branches = map { $_ => 1 } qw(breq brne brcs brcc brsh brlo brmi brpl brge
+                                  brlt brhs brhc brts brtc brvs brvc brie brid
+                                  brbs brbc);
+my %skips = map { $_ => 1 } qw(cpse sbrc sbrs sbic sbis);
+
+# interrupt response (4) and the jmp in the vector table (3)
+my $entry_cycles = 7;
+
+#
+# parse the disassembly into functions
+#
+my (%functions, $current);
+
+while (my $line = <>) {
+    if ($line =~ /^([0-9a-f]+) <([^>]+)>:/) {
+        $current = $2;
+        $functions{$current} = { name => $current, start => hex($1), insns => [] };
+        next;
+    }
+    next unless defined($current);
+    next unless $line =~ /^\s*([0-9a-f]+):\s+((?:[0-9a-f]{2} )+)\s*(\S+)\s*([^;]*?)\s*(?:;\s*(.*))?$/;
+
+    my ($addr, $bytes, $mnemonic, $operands, $comment) = (hex($1), $2, $3, $4, $5 // '');
+    my $insn = {
+        addr => $addr,
+        size => scalar(split(' ', $bytes)),
+        mnemonic => $mnemonic,
+        function => $current,
+    };
+
+    if ($branches{$mnemonic} || $mnemonic =~ /^(rjmp|jmp|rcall|call)$/) {
+        if ($comment =~ /^0x([0-9a-f]+)/) {
+            $insn->{target} = hex($1);
+        } elsif ($operands =~ /(?:^|,\s*)\.([+-]\d+)$/) {
+            $insn->{target} = $addr + 2 + $1;
+        } elsif ($operands =~ /^0x([0-9a-f]+)$/) {
+            $insn->{target} = hex($1);
+        }
+    }
+
+    push @{$functions{$current}->{insns}}, $insn;
+}
+
+my %function_at = map { $_->{start} => $_ } values %functions;
+
+#
+# worst-case path analysis
+#
+my %memo;
+my %active;
+# per function: what could not be counted, including in its callees
+my %incomplete;
+
+sub incomplete {
+    my ($f, @reasons) = @_;
+    $incomplete{$f->{name}}->{$_} = 1 for @reasons;
+}
+
+sub insn_cost {
+    my ($insn) = @_;
+    my $m = $insn->{mnemonic};
+
+    return $cycles{$m} if exists $cycles{$m};
+    return 1 if $branches{$m} || $skips{$m};
+    warn "unknown instruction '$m' at " . sprintf('0x%x', $insn->{addr}) . ", counting 2 cycles\n";
+    return 2;
+}
+
+# cycles of a function called or tail-called from $f, the callee's
+# uncounted parts are inherited
+sub callee_cost {
+    my ($f, $callee) = @_;
+    my $cost = function_cost($callee->{name});
+    incomplete($f, keys %{$incomplete{$callee->{name}} // {}});
+    return $cost;
+}
+
+# cycles of a call, including the callee
+sub call_cost {
+    my ($f, $insn) = @_;
+    my $at = sprintf('0x%x', $insn->{addr});
+
+    return 0 unless $insn->{mnemonic} =~ /^(rcall|call|icall)$/;
+
+    if ($insn->{mnemonic} eq 'icall') {
+        incomplete($f, "indirect call at $at in $f->{name}");
+        return 0;
+    }
+
+    # rcall .+0 is used to reserve stack space, it does not call anything
+    return 0 if $insn->{mnemonic} eq 'rcall' && defined($insn->{target})
+        && $insn->{target} == $insn->{addr} + 2;
+
+    my $callee = $function_at{$insn->{target} // -1};
+    if (!defined($callee)) {
+        incomplete($f, "call to unknown address at $at in $f->{name}");
+        return 0;
+    }
+    return callee_cost($f, $callee);
+}
+
+# Longest path from instruction index $from to $to (inclusive) of the given
+# function. Backward jumps close loops: the loop body is walked once by the
+# forward pass, the remaining ($loop_bound - 1) iterations are added at the
+# loop head. If $to is undef, the longest path to any ret/reti is returned,
+# undef if there is none.
+sub longest_path {
+    my ($f, $from, $to) = @_;
+    my @insns = @{$f->{insns}};
+    my %index = map { $insns[$_]->{addr} => $_ } 0 .. $#insns;
+    my $last = defined($to) ? $to : $#insns;
+    my $bound = $loop_bounds{$f->{name}} // $loop_bound;
+
+    # loop heads inside this range and the extra cost of their loops
+    my %extra;
+    for my $i ($from .. $last) {
+        my $t = $insns[$i]->{target};
+        next unless defined($t) && exists($index{$t}) && $insns[$i]->{mnemonic} !~ /call/;
+        my $head = $index{$t};
+        next if $head > $i || $head < $from || ($head == $from && $i == $last);
+        my $body = longest_path($f, $head, $i);
+        next unless defined($body);
+        my $back = insn_cost($insns[$i]) + ($branches{$insns[$i]->{mnemonic}} ? 1 : 0);
+        my $more = ($bound - 1) * ($body + $back);
+        printf STDERR "    loop 0x%x-0x%x in %s: %d cycles, %d times\n", $t, $insns[$i]->{addr},
+            $f->{name}, $body + $back, $bound if $verbose && !defined($to);
+        $extra{$head} = $more if !exists($extra{$head}) || $extra{$head} < $more;
+    }
+
+    my @dist = (undef) x @insns;
+    $dist[$from] = 0;
+    my $best;
+
+    for my $i ($from .. $last) {
+        next unless defined($dist[$i]);
+        my $insn = $insns[$i];
+        my $m = $insn->{mnemonic};
+        my $d = $dist[$i] + ($extra{$i} // 0) + insn_cost($insn) + call_cost($f, $insn);
+
+        if (defined($to) && $i == $to) {
+            # cost of the loop-closing jump itself is added by the caller
+            $best = $dist[$i] + ($extra{$i} // 0) + call_cost($f, $insn);
+            last;
+        }
+
+        if ($m eq 'ret' || $m eq 'reti') {
+            $best = $d if !defined($best) || $d > $best;
+            next;
+        }
+
+        my @succ;
+        if ($m eq 'rjmp' || $m eq 'jmp') {
+            my $t = $insn->{target};
+            if (defined($t) && exists($index{$t})) {
+                push @succ, [$index{$t}, 0];
+            } elsif (defined($t) && $function_at{$t}) {
+                # tail call
+                my $c = callee_cost($f, $function_at{$t});
+                $best = $d + $c if defined($c) && (!defined($best) || $d + $c > $best);
+            } else {
+                # the path goes on somewhere, but not anywhere we know
+                incomplete($f, sprintf('jump to unknown address at 0x%x in %s', $insn->{addr}, $f->{name}));
+                $best = $d if !defined($best) || $d > $best;
+            }
+        } elsif ($m eq 'ijmp') {
+            incomplete($f, sprintf('indirect jump at 0x%x in %s', $insn->{addr}, $f->{name}));
+            $best = $d if !defined($best) || $d > $best;
+        } elsif ($branches{$m}) {
+            push @succ, [$i + 1, 0];
+            push @succ, [$index{$insn->{target}}, 1] if defined($insn->{target}) && exists($index{$insn->{target}});
+        } elsif ($skips{$m}) {
+            push @succ, [$i + 1, 0];
+            push @succ, [$i + 2, $insns[$i + 1] ? $insns[$i + 1]->{size} / 2 : 1] if $i + 2 <= $#insns;
+        } else {
+            push @succ, [$i + 1, 0];
+        }
+
+        for my $s (@succ) {
+            my ($j, $penalty) = @$s;
+            next if $j <= $i || $j > $last;
+            my $n = $d + $penalty;
+            $dist[$j] = $n if !defined($dist[$j]) || $n > $dist[$j];
+        }
+    }
+
+    return $best;
+}
+
+sub function_cost {
+    my ($name) = @_;
+
+    return $memo{$name} if exists $memo{$name};
+    if ($active{$name}) {
+        incomplete($functions{$name}, "recursion through $name");
+        return 0;
+    }
+
+    $active{$name} = 1;
+    my $f = $functions{$name};
+    my $cost = @{$f->{insns}} ? longest_path($f, 0, undef) : 0;
+    delete $active{$name};
+
+    $memo{$name} = $cost;
+    return $cost;
+}
+
+#
+# report
+#
+my $char_cycles = int($f_cpu * 11 / $baud);
+my $limit = int($char_cycles * $budget / 100);
+my $failed = 0;
+
+printf "%s at %.1f MHz, %d baud: %d cycles per character, budget %d cycles (%d %%)\n",
+    $mcu, $f_cpu / 1e6, $baud, $char_cycles, $limit, $budget;
+
+for my $f (sort { $a->{start} <=> $b->{start} } values %functions) {
+    next unless $f->{name} =~ /^__vector_(\d+)$/;
+    my $vector = $1;
+    my $name = $vectors{$mcu} ? ($vectors{$mcu}->[$vector] // "vector $vector") : "vector $vector";
+
+    my $cost = function_cost($f->{name});
+    if (!defined($cost)) {
+        printf "  %-14s never returns\n", $name;
+        next;
+    }
+
+    if ($verbose) {
+        printf "      %-20s %6d cycles\n", $_, $memo{$_}
+            for grep { defined($memo{$_}) && $_ ne $f->{name} } sort keys %memo;
+    }
+
+    $cost += $entry_cycles;
+    my @unknown = sort keys %{$incomplete{$f->{name}} // {}};
+    my $ok = $cost <= $limit;
+    my $verdict = !$ok ? 'OVER BUDGET' : @unknown ? 'INCOMPLETE' : 'ok';
+    $failed++ unless $ok && (!@unknown || $allow_incomplete);
+    printf "  %-14s %s%6d cycles %8.1f us  %s\n", $name, @unknown ? '>=' : '  ', $cost,
+        $cost * 1e6 / $f_cpu, $verdict;
+    print "      not counted: $_\n" for @unknown;
+}
+
+exit($failed ? 1 : 0);